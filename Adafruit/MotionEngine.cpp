@@ -0,0 +1,542 @@
+/**
+ * @file MotionEngine.cpp
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Implementation of the per-shield stepping thread.
+ * @version 2.0.0
+ * @date 2022-04-09
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "MotorShield.hpp"
+#include "meb_print.h"
+#include <time.h>
+#include <math.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#ifndef _DOXYGEN_
+static inline uint64_t get_timestamp()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000000LLU + ts.tv_nsec);
+}
+
+/**
+ * @brief Stack touched by a real-time engine thread before it steps, well above
+ * the depth of the stepping path (bus transfer and completion callbacks).
+ *
+ */
+#define ENGINE_STACK_PREFAULT (128 * 1024)
+
+static std::mutex mlock_lock; // guards mlock_users
+static int mlock_users = 0;   // engines that want the process memory locked
+#endif // _DOXYGEN_
+
+namespace Adafruit
+{
+    MotionEngine::MotionEngine(MotorShield *shield)
+    {
+        MC = shield;
+        quit = false;
+        prefault = false;
+        started = false;
+        rt.priority = 0;
+        rt.cpu = -1;
+        rt.lock_memory = false;
+        mlocked = false;
+        CPU_ZERO(&cpus);
+        sem_init(&wake, 0, 0);
+        for (int i = 0; i < 2; i++)
+        {
+            ports[i].active = false;
+            ports[i].next = 0;
+            ports[i].hold = 0;
+            ports[i].io_last = 0;
+            ports[i].ahead_first = ports[i].ahead_count = 0;
+            ports[i].nsub = ports[i].isub = 0;
+            ports[i].held = false;
+            ports[i].carry = false;
+        }
+    }
+
+    MotionEngine::~MotionEngine()
+    {
+        shutdown();
+        lockMemory(false);
+        sem_destroy(&wake);
+    }
+
+    void MotionEngine::start()
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        if (started)
+            return;
+        quit = false;
+        thr = std::thread(threadFn, this);
+        started = true;
+        pthread_getaffinity_np(thr.native_handle(), sizeof(cpus), &cpus);
+        if (rt.priority > 0 || rt.cpu >= 0)
+            applyRealtime();
+    }
+
+    void MotionEngine::shutdown()
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        if (!started)
+            return;
+        quit = true;
+        sem_post(&wake);
+        thr.join();
+        for (int i = 0; i < 2; i++)
+            abort(i);
+        started = false;
+    }
+
+    void MotionEngine::kick()
+    {
+        sem_post(&wake);
+    }
+
+    bool MotionEngine::configure(const RealtimeConfig &cfg)
+    {
+        if (cfg.priority < 0 || cfg.priority > sched_get_priority_max(SCHED_FIFO) || cfg.cpu < -1 || cfg.cpu >= CPU_SETSIZE)
+        {
+            dbprintlf("Invalid real-time settings: priority %d, CPU %d", cfg.priority, cfg.cpu);
+            return false;
+        }
+        std::lock_guard<std::mutex> lk(lock);
+        rt = cfg;
+        bool ret = lockMemory(cfg.lock_memory);
+        if (started)
+            ret &= applyRealtime();
+        return ret;
+    }
+
+    RealtimeConfig MotionEngine::realtime() const
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        return rt;
+    }
+
+    bool MotionEngine::applyRealtime()
+    {
+        bool ret = true;
+        struct sched_param sp = {};
+        sp.sched_priority = rt.priority;
+        int err = pthread_setschedparam(thr.native_handle(), rt.priority > 0 ? SCHED_FIFO : SCHED_OTHER, &sp);
+        if (err)
+        {
+            dbprintlf("Could not set priority %d on the motion engine: %s", rt.priority, strerror(err));
+            ret = false;
+        }
+        cpu_set_t set = cpus;
+        if (rt.cpu >= 0)
+        {
+            CPU_ZERO(&set);
+            CPU_SET(rt.cpu, &set);
+        }
+        err = pthread_setaffinity_np(thr.native_handle(), sizeof(set), &set);
+        if (err)
+        {
+            dbprintlf("Could not pin the motion engine to CPU %d: %s", rt.cpu, strerror(err));
+            ret = false;
+        }
+        if (rt.priority > 0 || rt.lock_memory)
+        {
+            prefault = true;
+            kick();
+        }
+        return ret;
+    }
+
+    bool MotionEngine::lockMemory(bool on)
+    {
+        if (on == mlocked)
+            return true;
+        std::lock_guard<std::mutex> lk(mlock_lock);
+        if (on && mlock_users == 0 && mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+        {
+            dbprintlf("Could not lock the process memory: %s", strerror(errno));
+            return false;
+        }
+        mlock_users += on ? 1 : -1;
+        if (!on && mlock_users == 0)
+            munlockall();
+        mlocked = on;
+        return true;
+    }
+
+    __attribute__((noinline)) void MotionEngine::prefaultStack()
+    {
+        volatile uint8_t stack[ENGINE_STACK_PREFAULT];
+        for (size_t i = 0; i < sizeof(stack); i += 4096)
+            stack[i] = 0;
+    }
+
+    void MotionEngine::threadFn(MotionEngine *self)
+    {
+        MotorShield::setBusClass(I2CBUS_PRIO_STEP);
+        self->run();
+    }
+
+    void MotionEngine::complete(int port, uint64_t seq, MoveResult result)
+    {
+        StepperMotor *mot = &MC->steppers[port];
+        MoveStatus &st = mot->queue.slot(seq);
+        MoveCallback cb = st.cb; // the slot can be reused once the reservation is released
+        void *user = st.user;
+        st.result.store(result);
+        mot->queue.release();
+        {
+            std::lock_guard<std::mutex> cs(mot->cs);
+            mot->cond.notify_all();
+        }
+        if (cb)
+            cb(mot, MoveHandle(mot, seq), result, user);
+    }
+
+    void MotionEngine::finish(int port)
+    {
+        Port &p = ports[port];
+        if (p.isub + 1 < p.nsub) // next part of a HYBRID move, from the last tick
+        {
+            p.cur = p.sub[++p.isub];
+            p.ticks = 0;
+            replan(port, p.cur.v_start, p.t_tick);
+            return;
+        }
+        p.active = false;
+        p.nsub = p.isub = 0;
+        complete(port, p.cur.seq, MOVE_DONE);
+    }
+
+    void MotionEngine::pace(int port, uint64_t io0, uint64_t sent)
+    {
+        Port &p = ports[port];
+        StepperMotor *mot = &MC->steppers[port];
+        if (sent > p.next) // the tick went out after the deadline of the next one
+            mot->missed_ticks++;
+        // when the frame would have started given a usual bus time: a frame held up on the bus counts as late
+        uint64_t io = sent - io0;
+        uint64_t t_eff = sent - (io < p.io_last ? io : p.io_last);
+        p.io_last = io;
+        uint64_t interval = p.next - p.t_tick;
+        if (mot->late_policy == LATE_STRETCH)
+        {
+            // more than half a step late: shift the plan, and the hand-over time, by the delay
+            if (t_eff > p.t_tick + interval / 2)
+            {
+                uint64_t shift = t_eff - p.t_tick;
+                p.t0 += shift;
+                p.t_tick += shift;
+                p.next += shift;
+                p.t_end += shift;
+            }
+        }
+        else if (mot->catchup > 0) // frames behind the schedule start no closer than interval / catchup
+            p.hold = t_eff + (uint64_t)(interval / mot->catchup);
+    }
+
+    void MotionEngine::abort(int port, uint64_t upto)
+    {
+        Port &p = ports[port];
+        bool dropped = false;
+        if (p.active && p.cur.seq <= upto)
+        {
+            p.active = false;
+            p.nsub = p.isub = 0;
+            complete(port, p.cur.seq, MOVE_ABORTED);
+            dropped = true;
+        }
+        for (; p.ahead_count && p.ahead[p.ahead_first].seq <= upto; p.ahead_count--)
+        {
+            complete(port, p.ahead[p.ahead_first].seq, MOVE_ABORTED);
+            p.ahead_first = (p.ahead_first + 1) % STEPPER_QUEUE_LEN;
+            dropped = true;
+        }
+        if (dropped) // whatever runs next starts from rest
+            p.carry = false;
+        StepperMove mv;
+        while (MC->steppers[port].queue.pop(mv, upto)) // moves queued after the stop request stay
+            complete(port, mv.seq, MOVE_ABORTED);
+    }
+
+    uint64_t MotionEngine::stopSeq(int port) const
+    {
+        const StepperMotor *mot = &MC->steppers[port];
+        return *(mot->done) ? UINT64_MAX : mot->stop_seq.load();
+    }
+
+    bool MotionEngine::blends(const StepperMove &a, const StepperMove &b)
+    {
+        return a.steps > 0 && b.steps > 0 && a.style != HYBRID && a.dir == b.dir && a.style == b.style && a.msteps == b.msteps && a.accel > 0 && b.accel > 0;
+    }
+
+    bool MotionEngine::handsOver(const Port &p) const
+    {
+        // only the last part of a HYBRID move can blend into the next move
+        return p.isub + 1 >= p.nsub && p.ahead_count && blends(p.cur, p.ahead[p.ahead_first]);
+    }
+
+    void MotionEngine::split(int port)
+    {
+        Port &p = ports[port];
+        const StepperMove hy = p.cur;
+        int N = hy.msteps, phase = MC->steppers[port].currentstep;
+        // double coil steps land on phase N/2 modulo N: microstep there first
+        uint64_t align = (hy.dir == FORWARD ? N / 2 - phase : phase - N / 2) & (N - 1);
+        align = align < hy.steps ? align : hy.steps;
+        uint64_t rest = hy.steps - align;
+        uint64_t coarse = rest > hy.fine ? (rest - hy.fine) / N : 0;
+        uint64_t fine = rest - coarse * N;
+        StepperMove micro = hy;
+        micro.style = MICROSTEP;
+        micro.v_start = micro.v_cruise = micro.v_end = hy.v_fine;
+        micro.accel = micro.jerk = 0;
+        p.nsub = p.isub = 0;
+        if (align)
+        {
+            p.sub[p.nsub] = micro;
+            p.sub[p.nsub++].steps = align;
+        }
+        if (coarse)
+        {
+            p.sub[p.nsub] = hy;
+            p.sub[p.nsub].style = DOUBLE;
+            p.sub[p.nsub++].steps = coarse;
+        }
+        if (fine)
+        {
+            p.sub[p.nsub] = micro;
+            p.sub[p.nsub++].steps = fine;
+        }
+        p.cur = p.sub[0];
+    }
+
+    double MotionEngine::exitVelocity(const Port &p, double dist, double v_in) const
+    {
+        if (p.isub + 1 < p.nsub)
+            return p.cur.v_end;
+        // moves waiting behind the running one that it can blend into
+        unsigned n = 0;
+        const StepperMove *last = &p.cur;
+        while (n < p.ahead_count && blends(*last, p.ahead[(p.ahead_first + n) % STEPPER_QUEUE_LEN]))
+            last = &p.ahead[(p.ahead_first + n++) % STEPPER_QUEUE_LEN];
+        if (n == 0)
+            return p.cur.v_end;
+        // backward from the end of the chain: highest velocity each move can be entered
+        // with and still reach the exit velocity of the move, within the speed of both neighbours
+        double v = last->v_end;
+        for (unsigned k = n; k-- > 0;)
+        {
+            const StepperMove &m = p.ahead[(p.ahead_first + k) % STEPPER_QUEUE_LEN];
+            const StepperMove &before = k ? p.ahead[(p.ahead_first + k - 1) % STEPPER_QUEUE_LEN] : p.cur;
+            v = MotionPlan::reachable(v, m.v_cruise, m.steps, m.accel, m.jerk);
+            v = v < before.v_cruise ? v : before.v_cruise;
+        }
+        // forward: the running move has to get from v_in to the hand-over velocity
+        return MotionPlan::reachable(v_in, v, dist, p.cur.accel, p.cur.jerk);
+    }
+
+    unsigned MotionEngine::stage(int port)
+    {
+        Port &p = ports[port];
+        MoveQueue &q = MC->steppers[port].queue;
+        unsigned n = 0;
+        while (p.ahead_count < STEPPER_QUEUE_LEN && q.pop(p.ahead[(p.ahead_first + p.ahead_count) % STEPPER_QUEUE_LEN]))
+        {
+            p.ahead_count++;
+            n++;
+        }
+        return n;
+    }
+
+    void MotionEngine::replan(int port, double v_in, uint64_t t_start)
+    {
+        Port &p = ports[port];
+        uint64_t left = p.cur.steps - p.ticks;
+        double v_out = exitVelocity(p, left, v_in);
+        p.carry = handsOver(p);
+        p.plan.plan(left, v_in, p.cur.v_cruise, v_out, p.cur.accel, p.cur.jerk);
+        p.v_carry = v_out;
+        p.t0 = t_start;
+        p.k0 = p.ticks;
+        p.t_end = p.t0 + llround(p.plan.duration() * 1e9);
+        p.next = p.t0 + llround(p.plan.tickTime(1) * 1e9);
+    }
+
+    void MotionEngine::retarget(int port, uint64_t usperstep)
+    {
+        Port &p = ports[port];
+        // cruise velocity of a move at the new speed, HYBRID moves cruise in double coil steps
+        auto cruise = [usperstep](const StepperMove &m)
+        {
+            double tps = m.style == INTERLEAVE ? 2 : (m.style == MICROSTEP ? m.msteps : 1);
+            return 1e6 * tps / usperstep;
+        };
+        for (unsigned k = 0; k < p.ahead_count; k++)
+        {
+            StepperMove &m = p.ahead[(p.ahead_first + k) % STEPPER_QUEUE_LEN];
+            if (m.steps)
+                m.v_cruise = cruise(m);
+        }
+        for (unsigned k = p.isub + 1; k < p.nsub; k++)
+            if (p.sub[k].style == DOUBLE)
+                p.sub[k].v_cruise = cruise(p.sub[k]);
+        if (!p.active || p.cur.steps == 0 || (p.nsub && p.cur.style == MICROSTEP)) // idle, dwelling or on the final approach
+            return;
+        p.cur.v_cruise = cruise(p.cur);
+        uint64_t t_ref = p.ticks > p.k0 ? p.t_tick : p.t0;
+        replan(port, p.plan.velocity((t_ref - p.t0) * 1e-9), t_ref);
+    }
+
+    void MotionEngine::activate(int port, uint64_t now)
+    {
+        Port &p = ports[port];
+        p.cur = p.ahead[p.ahead_first];
+        p.ahead_first = (p.ahead_first + 1) % STEPPER_QUEUE_LEN;
+        p.ahead_count--;
+        MC->steppers[port].queue.slot(p.cur.seq).result.store(MOVE_RUNNING);
+        p.active = true;
+        p.held = false;
+        p.ticks = 0;
+        if (p.cur.style == HYBRID)
+            split(port);
+        if (p.cur.steps == 0) // dwell
+        {
+            p.carry = false;
+            p.t0 = now;
+            p.next = now + llround(p.cur.dwell * 1e9);
+        }
+        else if (p.carry) // blended: continue from the end of the previous move, at its end velocity
+            replan(port, p.v_carry, p.t_end);
+        else
+            replan(port, p.cur.v_start, now);
+    }
+
+    void MotionEngine::run()
+    {
+        while (!quit)
+        {
+            if (prefault.exchange(false))
+                prefaultStack();
+            uint64_t now = get_timestamp();
+            uint64_t t_start;
+            bool armed = MC->startArmed(t_start);
+            uint64_t deadline = UINT64_MAX;
+            for (int i = 0; i < 2; i++)
+            {
+                Port &p = ports[i];
+                StepperMotor *mot = &MC->steppers[i];
+                uint64_t speed = mot->speed_req.exchange(0); // before staging: moves queued before the change get it too
+                if (stage(i) && p.active && p.cur.steps && handsOver(p))
+                {
+                    // the running move can now hand over to a longer chain: replan the rest of it from the last tick
+                    uint64_t t_ref = p.ticks > p.k0 ? p.t_tick : p.t0;
+                    replan(i, p.plan.velocity((t_ref - p.t0) * 1e-9), t_ref);
+                }
+                if (speed)
+                    retarget(i, speed);
+                if (!p.active || p.cur.steps == 0) // idle or dwelling
+                {
+                    uint64_t upto = stopSeq(i);
+                    if (p.active ? p.cur.seq <= upto : p.ahead_count && p.ahead[p.ahead_first].seq <= upto)
+                        abort(i, upto);
+                    if (!p.active && p.ahead_count && !armed)
+                        activate(i, p.held ? t_start : now); // released moves share the time of allStart
+                    else if (!p.active)
+                    {
+                        p.carry = false; // held at the start gate: the motor comes to rest
+                        p.held = p.ahead_count > 0;
+                    }
+                }
+                uint64_t t_due = p.next > p.hold ? p.next : p.hold;
+                if (p.active && t_due < deadline)
+                    deadline = t_due;
+            }
+            if (deadline == UINT64_MAX || now < deadline)
+            {
+                if (deadline == UINT64_MAX)
+                    sem_wait(&wake);
+                else
+                {
+                    struct timespec ts = {(time_t)(deadline / 1000000000), (long)(deadline % 1000000000)};
+                    sem_clockwait(&wake, CLOCK_MONOTONIC, &ts);
+                }
+                while (sem_trywait(&wake) == 0) // one pass over the queues serves every kick so far
+                    ;
+                continue;
+            }
+
+            // step every port that is due, a dwell that is due is just over
+            bool due[2], go[2] = {false, false};
+            for (int i = 0; i < 2; i++)
+            {
+                due[i] = ports[i].active && ports[i].next <= now && ports[i].hold <= now;
+                if (due[i] && ports[i].cur.steps == 0)
+                {
+                    finish(i);
+                    due[i] = false;
+                }
+            }
+            uint64_t io0 = get_timestamp();
+            {
+                // MotorShield::allOff marks the moves to stop and broadcasts under this lock, a frame can not slip in after the broadcast
+                std::lock_guard<std::recursive_mutex> regs(MC->regs);
+                for (int i = 0; i < 2; i++)
+                {
+                    if (!due[i])
+                        continue;
+                    const StepperMove &mv = ports[i].cur;
+                    // if at odd microstep we HAVE to step until we reach an integral step,
+                    // unless allOff switched the coils off: no frame may energize them again
+                    bool align = mv.style == MICROSTEP && ((mv.steps - ports[i].ticks) % mv.msteps) && mv.seq > MC->steppers[i].off_seq;
+                    go[i] = align || mv.seq > stopSeq(i);
+                }
+                if (go[0] && go[1] && ports[0].cur.style == ports[1].cur.style)
+                    MC->onestepBoth(ports[0].cur.dir, ports[1].cur.dir, ports[0].cur.style);
+                else if (go[0] && go[1])
+                {
+                    MC->beginTransaction();
+                    for (int i = 0; i < 2; i++)
+                        MC->steppers[i].onestep(ports[i].cur.dir, ports[i].cur.style);
+                    MC->commit();
+                }
+                else
+                {
+                    for (int i = 0; i < 2; i++)
+                        if (go[i])
+                            MC->steppers[i].onestep(ports[i].cur.dir, ports[i].cur.style);
+                }
+            }
+            uint64_t sent = get_timestamp();
+            for (int i = 0; i < 2; i++)
+                if (go[i])
+                    MC->steppers[i].tickDone(sent, sent - io0, ports[i].cur.style, ports[i].ticks == 0 && ports[i].isub == 0);
+            for (int i = 0; i < 2; i++)
+            {
+                if (!due[i])
+                    continue;
+                Port &p = ports[i];
+                if (!go[i])
+                {
+                    abort(i, stopSeq(i));
+                    continue;
+                }
+                p.t_tick = p.next;
+                if (++p.ticks == p.cur.steps)
+                    finish(i);
+                else
+                {
+                    p.next = p.t0 + llround(p.plan.tickTime(p.ticks - p.k0 + 1) * 1e9);
+                    pace(i, io0, sent);
+                }
+            }
+        }
+    }
+};
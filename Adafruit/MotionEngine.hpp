@@ -0,0 +1,196 @@
+/**
+ * @file MotionEngine.hpp
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Long-lived stepping thread of a motor shield. Runs the moves of both
+ * stepper ports from one timing source with absolute deadlines, so a move
+ * starts with a queue push instead of a timer and thread creation.
+ * @version 2.0.0
+ * @date 2022-04-09
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef _MotionEngine_hpp_
+#define _MotionEngine_hpp_
+
+#include <stdint.h>
+#include <sched.h>
+#include <semaphore.h>
+#include "StepTables.hpp"
+#include "MotionProfile.hpp"
+#include "MoveQueue.hpp"
+
+#include <mutex>
+#include <thread>
+#include <atomic>
+
+namespace Adafruit
+{
+    class MotorShield;
+    class StepperMotor;
+
+    /**
+     * @brief What the motion engine does when a step tick is made after the deadline
+     * of the tick following it (the engine thread was delayed), see
+     * {@link Adafruit::StepperMotor::setLatePolicy}.
+     *
+     */
+    enum LatePolicy
+    {
+        LATE_CATCHUP = 0, ///< Keep the planned duration: late ticks are made at up to a set multiple of the planned rate until the move is back on schedule
+        LATE_STRETCH      ///< Keep the step intervals: the rest of the move, and the moves blended into it, are delayed by the time lost
+    };
+
+    /**
+     * @brief Real-time settings of the stepping thread of a shield, see {@link Adafruit::MotorShield::setRealtime}.
+     *
+     */
+    struct RealtimeConfig
+    {
+        int priority;     ///< SCHED_FIFO priority (1-99), 0 for the default time-sharing scheduler
+        int cpu;          ///< CPU to pin the thread to, -1 to let it run on the CPUs it started with
+        bool lock_memory; ///< Lock the pages of the process in memory (mlockall), so stepping does not wait on page faults
+    };
+
+    /**
+     * @brief Stepping thread of a {@link Adafruit::MotorShield}. Each stepper motor
+     * has a lock-free queue of moves; the engine sleeps until the earliest step deadline
+     * of the active moves, steps every port that is due (both ports in one bus
+     * transfer) and takes the next deadline from the move's {@link Adafruit::MotionPlan},
+     * relative to the start of the move, so the time spent on the bus does not
+     * accumulate into the step period.
+     *
+     * Moves waiting on a port are looked at before a move starts: a move that
+     * is followed by moves in the same direction, style and resolution, all with
+     * an acceleration limit, hands its velocity over to the next one instead of
+     * ramping down to the start speed. The hand-over velocity is the highest from
+     * which the rest of the chain can still come to its end speed, so a direction
+     * reversal, a dwell, a change of style or the end of the queue is where the
+     * motor slows down.
+     *
+     * A speed change requested with {@link Adafruit::StepperMotor::setSpeed} during
+     * a move is applied to the running and waiting moves of the port, and the rest
+     * of the running move is replanned from its last tick at the velocity it had
+     * there, so the change respects the acceleration limit.
+     *
+     * A tick made after the deadline of the tick following it counts as missed on
+     * the motor. A move that falls behind its plan either catches up at a limited
+     * rate or has the rest of its plan shifted by the delay, as set with
+     * {@link Adafruit::StepperMotor::setLatePolicy}.
+     *
+     * A HYBRID move is split when it starts, at the phase the motor is then at:
+     * microsteps up to the next double coil position, double coil steps for the
+     * travel and microsteps for the final approach, all on the motor's one phase
+     * counter.
+     *
+     */
+    class MotionEngine
+    {
+    public:
+        /**
+         * @brief Create an engine for the stepper ports of a shield. The thread is started by {@link Adafruit::MotionEngine::start}.
+         *
+         * @param shield Shield whose steppers the engine drives.
+         */
+        MotionEngine(MotorShield *shield);
+
+        /**
+         * @brief Stop the thread, abandoning queued moves.
+         *
+         */
+        ~MotionEngine();
+
+        /**
+         * @brief Start the stepping thread, if not running.
+         *
+         */
+        void start();
+
+        /**
+         * @brief Abort all moves and stop the stepping thread.
+         *
+         */
+        void shutdown();
+
+        /**
+         * @brief Make the engine re-check the move queues, stop flags and the start
+         * gate now instead of at the next step deadline. Does not block, so it
+         * can be called from any thread after queueing a move.
+         *
+         */
+        void kick();
+
+        /**
+         * @brief Set the scheduling policy, priority and CPU affinity of the stepping
+         * thread and lock the process memory. Settings apply to the running thread and
+         * to threads started later; the stack of the thread is touched on its next
+         * pass so it does not fault while stepping.
+         *
+         * @param cfg Real-time settings, all zero (cpu -1) to return to normal scheduling.
+         * @return bool true if every setting was applied, false if one was refused (e.g. EPERM without CAP_SYS_NICE or CAP_IPC_LOCK).
+         */
+        bool configure(const RealtimeConfig &cfg);
+
+        /**
+         * @brief Get the real-time settings last requested with {@link Adafruit::MotionEngine::configure}.
+         *
+         * @return RealtimeConfig Real-time settings.
+         */
+        RealtimeConfig realtime() const;
+
+    private:
+        struct Port
+        {
+            StepperMove cur; // running move
+            bool active;     // cur is running
+            MotionPlan plan; // time plan of the rest of cur
+            uint64_t t0;     // CLOCK_MONOTONIC start time of plan
+            uint64_t k0;     // ticks of cur done when plan was made
+            uint64_t ticks;  // ticks of cur done
+            uint64_t t_tick; // CLOCK_MONOTONIC deadline of the last tick made
+            uint64_t next;   // CLOCK_MONOTONIC deadline of the next step tick
+            uint64_t hold;   // CLOCK_MONOTONIC time before which no tick is made, catch-up rate limit
+            uint64_t io_last; // bus time of the last frame of the port, ns
+            StepperMove ahead[STEPPER_QUEUE_LEN]; // moves taken off the queue for look-ahead
+            unsigned ahead_first, ahead_count;
+            StepperMove sub[3]; // parts of a HYBRID move: align to a full step, full steps, fine approach
+            unsigned nsub, isub; // parts of the running move, cur is sub[isub] if nsub > 0
+            bool held;       // ahead[ahead_first] waited at the start gate
+            bool carry;      // cur hands its end velocity over to ahead[ahead_first]
+            double v_carry;  // velocity at the end of cur, ticks/s
+            uint64_t t_end;  // CLOCK_MONOTONIC planned end of cur
+        };
+        static void threadFn(MotionEngine *self);
+        static bool blends(const StepperMove &a, const StepperMove &b);
+        bool handsOver(const Port &p) const;
+        void split(int port);
+        double exitVelocity(const Port &p, double dist, double v_in) const;
+        unsigned stage(int port);
+        void replan(int port, double v_in, uint64_t t_start);
+        void retarget(int port, uint64_t usperstep);
+        void activate(int port, uint64_t now);
+        void run();
+        void complete(int port, uint64_t seq, MoveResult result);
+        void finish(int port);
+        void pace(int port, uint64_t io0, uint64_t sent);
+        void abort(int port, uint64_t upto = UINT64_MAX);
+        uint64_t stopSeq(int port) const;
+        bool applyRealtime();
+        bool lockMemory(bool on);
+        static void prefaultStack();
+        MotorShield *MC;
+        std::thread thr;
+        mutable std::mutex lock; // serializes start(), shutdown() and configure(), ports belong to the thread
+        sem_t wake;      // posted by kick(), lock-free for the producers
+        std::atomic<bool> quit;
+        std::atomic<bool> prefault; // touch the stack on the next pass of the thread
+        bool started;
+        RealtimeConfig rt;   // requested real-time settings
+        bool mlocked;        // this engine holds a reference on the process memory lock
+        cpu_set_t cpus;      // affinity of the thread when it started, restored for cpu -1
+        Port ports[2];
+    };
+};
+
+#endif
@@ -0,0 +1,220 @@
+/**
+ * @file MotionProfile.cpp
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Implementation of the stepper move planner.
+ * @version 2.0.0
+ * @date 2022-04-09
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "MotionProfile.hpp"
+#include <math.h>
+
+namespace Adafruit
+{
+    MotionPlan::MotionPlan()
+    {
+        nseg = 0;
+        cur = 0;
+        tcur = 0;
+        vpeak = 0;
+        total = 0;
+    }
+
+    double MotionPlan::rampDistance(double v_a, double v_b, double accel, double jerk)
+    {
+        double dv = fabs(v_b - v_a);
+        if (accel <= 0 || dv <= 0)
+            return 0;
+        double t;
+        if (jerk <= 0)
+            t = dv / accel;
+        else if (dv >= accel * accel / jerk)
+            t = dv / accel + accel / jerk;
+        else
+            t = 2 * sqrt(dv / jerk);
+        // the ramp is point symmetric about its midpoint, so the mean velocity is the midpoint velocity
+        return t * (v_a + v_b) / 2;
+    }
+
+    double MotionPlan::reachable(double v_a, double v_b, double dist, double accel, double jerk)
+    {
+        if (accel <= 0 || rampDistance(v_a, v_b, accel, jerk) <= dist)
+            return v_b;
+        // the ramp distance grows monotonically as the target moves away from v_a
+        double lo = v_a, hi = v_b;
+        for (int i = 0; i < 60; i++)
+        {
+            double mid = (lo + hi) / 2;
+            if (rampDistance(v_a, mid, accel, jerk) > dist)
+                hi = mid;
+            else
+                lo = mid;
+        }
+        return lo;
+    }
+
+    void MotionPlan::addSegment(double t, double j)
+    {
+        seg[nseg++] = {t, s, v, a, j};
+        s += v * t + a * t * t / 2 + j * t * t * t / 6;
+        v += a * t + j * t * t / 2;
+        a += j * t;
+    }
+
+    void MotionPlan::addRamp(double v_a, double v_b, double accel, double jerk)
+    {
+        double dv = fabs(v_b - v_a);
+        double sign = v_b > v_a ? 1 : -1;
+        if (dv <= 0)
+            return;
+        if (jerk <= 0)
+        {
+            a = sign * accel; // acceleration steps at the start of the ramp
+            addSegment(dv / accel, 0);
+        }
+        else if (dv >= accel * accel / jerk)
+        {
+            double tj = accel / jerk;
+            addSegment(tj, sign * jerk);
+            addSegment(dv / accel - tj, 0);
+            addSegment(tj, -sign * jerk);
+        }
+        else
+        {
+            double tj = sqrt(dv / jerk);
+            addSegment(tj, sign * jerk);
+            addSegment(tj, -sign * jerk);
+        }
+        // end exactly on v_b, without the rounding of the segment sums
+        v = v_b;
+        a = 0;
+    }
+
+    void MotionPlan::plan(double dist, double v_start, double v_cruise, double v_end, double accel, double jerk)
+    {
+        nseg = 0;
+        cur = 0;
+        tcur = 0;
+        s = a = 0;
+        if (accel <= 0 || dist <= 0)
+        {
+            v = v_cruise;
+            addSegment(dist > 0 ? dist / v_cruise : 0, 0);
+            vpeak = v_cruise;
+            total = seg[0].t;
+            return;
+        }
+        v_end = v_end < v_cruise ? v_end : v_cruise;
+        v_end = reachable(v_start, v_end, dist, accel, jerk);
+        double vp = v_cruise;
+        bool fits = rampDistance(v_start, vp, accel, jerk) + rampDistance(vp, v_end, accel, jerk) <= dist;
+        if (v_start > v_cruise && !fits)
+        {
+            // entered above the cruise speed (the speed was lowered during the move), too short to
+            // slow down to it: lowest speed to slow down to that still ends at v_end
+            double lo = v_cruise, hi = v_start;
+            for (int i = 0; i < 60; i++)
+            {
+                double mid = (lo + hi) / 2;
+                if (rampDistance(v_start, mid, accel, jerk) + rampDistance(mid, v_end, accel, jerk) > dist)
+                    lo = mid;
+                else
+                    hi = mid;
+            }
+            vp = hi;
+        }
+        else if (v_start <= v_cruise && !fits)
+        {
+            // too short to reach cruise speed: highest peak that still ends at v_end
+            double lo = v_start > v_end ? v_start : v_end, hi = v_cruise;
+            for (int i = 0; i < 60; i++)
+            {
+                double mid = (lo + hi) / 2;
+                if (rampDistance(v_start, mid, accel, jerk) + rampDistance(mid, v_end, accel, jerk) > dist)
+                    hi = mid;
+                else
+                    lo = mid;
+            }
+            vp = lo;
+        }
+        double cruise = dist - rampDistance(v_start, vp, accel, jerk) - rampDistance(vp, v_end, accel, jerk);
+        v = v_start;
+        addRamp(v_start, vp, accel, jerk);
+        if (cruise > 0)
+            addSegment(cruise / vp, 0);
+        addRamp(vp, v_end, accel, jerk);
+        vpeak = vp > v_start ? vp : v_start;
+        total = 0;
+        for (int i = 0; i < nseg; i++)
+            total += seg[i].t;
+    }
+
+    double MotionPlan::tickTime(double k)
+    {
+        if (nseg == 0)
+            return 0;
+        // segment containing position k
+        while (cur < nseg - 1 && seg[cur + 1].s0 < k)
+        {
+            tcur += seg[cur].t;
+            cur++;
+        }
+        const ProfileSegment &sg = seg[cur];
+        double T = sg.t;
+        double send = sg.s0 + sg.v0 * T + sg.a0 * T * T / 2 + sg.j * T * T * T / 6;
+        if (send < k) // past the end of the plan (rounding): continue at the final velocity
+        {
+            double vend = sg.v0 + sg.a0 * T + sg.j * T * T / 2;
+            return tcur + T + (vend > 0 ? (k - send) / vend : 0);
+        }
+        // s(tau) is monotonic in the segment: safeguarded Newton
+        double lo = 0, hi = T, tau = T / 2;
+        for (int i = 0; i < 60; i++)
+        {
+            double f = sg.s0 + sg.v0 * tau + sg.a0 * tau * tau / 2 + sg.j * tau * tau * tau / 6 - k;
+            double fp = sg.v0 + sg.a0 * tau + sg.j * tau * tau / 2;
+            if (f > 0)
+                hi = tau;
+            else
+                lo = tau;
+            double next = fp > 0 ? tau - f / fp : -1;
+            if (next <= lo || next >= hi)
+                next = (lo + hi) / 2;
+            if (fabs(next - tau) < 1e-12)
+            {
+                tau = next;
+                break;
+            }
+            tau = next;
+        }
+        return tcur + tau;
+    }
+
+    double MotionPlan::velocity(double t) const
+    {
+        for (int i = 0; i < nseg; i++)
+        {
+            const ProfileSegment &sg = seg[i];
+            if (t <= sg.t || i == nseg - 1)
+            {
+                t = t < sg.t ? t : sg.t;
+                return sg.v0 + sg.a0 * t + sg.j * t * t / 2;
+            }
+            t -= sg.t;
+        }
+        return 0;
+    }
+
+    double MotionPlan::duration() const
+    {
+        return total;
+    }
+
+    double MotionPlan::peak() const
+    {
+        return vpeak;
+    }
+};
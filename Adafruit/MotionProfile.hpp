@@ -0,0 +1,145 @@
+/**
+ * @file MotionProfile.hpp
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Velocity profiles for stepper moves: constant speed, trapezoidal
+ * (acceleration limited) and S-curve (jerk limited). A move is planned as a
+ * short list of constant-jerk segments, from which the time of every step
+ * tick is found exactly.
+ * @version 2.0.0
+ * @date 2022-04-09
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef _MotionProfile_hpp_
+#define _MotionProfile_hpp_
+
+#include <stdint.h>
+
+namespace Adafruit
+{
+    /**
+     * @brief Velocity profile of a move.
+     *
+     */
+    enum MotionProfile
+    {
+        CONSTANT = 0, ///< Whole move at the set speed
+        TRAPEZOID,    ///< Constant acceleration up to the set speed and back down
+        SCURVE        ///< Jerk limited acceleration up to the set speed and back down
+    };
+
+    /**
+     * @brief Piece of a move with constant jerk.
+     *
+     */
+    struct ProfileSegment
+    {
+        double t;  ///< Duration, s
+        double s0; ///< Position at the start of the segment, ticks
+        double v0; ///< Velocity at the start of the segment, ticks/s
+        double a0; ///< Acceleration at the start of the segment, ticks/s^2
+        double j;  ///< Jerk, ticks/s^3
+    };
+
+    /**
+     * @brief Time plan of a single move. Distances are in step ticks (microsteps
+     * in MICROSTEP style), velocities in ticks per second.
+     *
+     */
+    class MotionPlan
+    {
+    public:
+        /**
+         * @brief Create an empty plan.
+         *
+         */
+        MotionPlan();
+
+        /**
+         * @brief Plan a move of dist ticks that starts at v_start, runs at up to v_cruise
+         * and ends at v_end. If the move is too short to reach v_cruise, the peak speed
+         * is lowered so that the move still ends at v_end; if it is too short to get
+         * from v_start to v_end at all, it ends at the closest reachable velocity. A v_start
+         * above v_cruise ramps down to v_cruise at the start of the move, or as far towards
+         * it as the distance allows.
+         *
+         * @param dist Distance, ticks.
+         * @param v_start Velocity at the start, ticks/s.
+         * @param v_cruise Maximum velocity, ticks/s.
+         * @param v_end Velocity at the end, ticks/s.
+         * @param accel Acceleration limit, ticks/s^2. 0 runs the whole move at v_cruise.
+         * @param jerk Jerk limit, ticks/s^3. 0 for a trapezoidal profile.
+         */
+        void plan(double dist, double v_start, double v_cruise, double v_end, double accel, double jerk);
+
+        /**
+         * @brief Get the time from the start of the move at which the position reaches
+         * tick k. Calls must be made with non-decreasing k.
+         *
+         * @param k Tick number, 1 for the first step of the move.
+         * @return double Time in seconds.
+         */
+        double tickTime(double k);
+
+        /**
+         * @brief Get the velocity at a time from the start of the move.
+         *
+         * @param t Time in seconds.
+         * @return double Velocity, ticks/s.
+         */
+        double velocity(double t) const;
+
+        /**
+         * @brief Get the planned duration of the move.
+         *
+         * @return double Duration in seconds.
+         */
+        double duration() const;
+
+        /**
+         * @brief Get the highest velocity of the move.
+         *
+         * @return double Velocity, ticks/s.
+         */
+        double peak() const;
+
+        /**
+         * @brief Get the distance needed to change velocity from v_a to v_b.
+         *
+         * @param v_a Initial velocity, ticks/s.
+         * @param v_b Final velocity, ticks/s.
+         * @param accel Acceleration limit, ticks/s^2.
+         * @param jerk Jerk limit, ticks/s^3, 0 for constant acceleration.
+         * @return double Distance, ticks.
+         */
+        static double rampDistance(double v_a, double v_b, double accel, double jerk);
+
+        /**
+         * @brief Get the velocity closest to v_b that can be reached from v_a within a distance.
+         * Ramps are symmetric, so this is also the velocity closest to v_b from which v_a can be reached.
+         *
+         * @param v_a Initial velocity, ticks/s.
+         * @param v_b Desired velocity, ticks/s.
+         * @param dist Distance available, ticks.
+         * @param accel Acceleration limit, ticks/s^2, 0 if velocity changes are free.
+         * @param jerk Jerk limit, ticks/s^3, 0 for constant acceleration.
+         * @return double Velocity, ticks/s, between v_a and v_b.
+         */
+        static double reachable(double v_a, double v_b, double dist, double accel, double jerk);
+
+    private:
+        ProfileSegment seg[7]; // accel (up to 3), cruise, decel (up to 3)
+        int nseg;
+        int cur;         // segment of the last tickTime() call
+        double tcur;     // start time of segment cur
+        double vpeak;    // highest velocity
+        double total;    // duration
+        double s, v, a;  // state at the end of the last segment added
+        void addRamp(double v_a, double v_b, double accel, double jerk);
+        void addSegment(double t, double j);
+    };
+};
+
+#endif
@@ -17,193 +17,204 @@
 #include "MotorShield.hpp"
 #include "meb_print.h"
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
+#include <time.h>
+#include <inttypes.h>
 
 #include <algorithm>
 #include <thread>
+#include <chrono>
+#include <vector>
 
 #ifndef _DOXYGEN_
 #define LOW 0
 #define HIGH 1
 
+#define LED0_ON_L 0x6
+#define LED0_ON_H 0x7
+#define LED0_OFF_L 0x8
+#define LED0_OFF_H 0x9
+
+#define ALLLED_ON_L 0xFA
+#define ALLLED_ON_H 0xFB
+#define ALLLED_OFF_L 0xFC
+#define ALLLED_OFF_H 0xFD
+
+#define PCA9685_SUBADR1 0x2
+#define PCA9685_SUBADR2 0x3
+#define PCA9685_SUBADR3 0x4
+
+#define PCA9685_ALLCALL_ADDR 0x70 // default ALLCALLADR
+#define ALLLED_FULL 0x10           // ALL_LED_ON_H/ALL_LED_OFF_H: full on/off bit
+
+#define PCA9685_MODE1 0x0
+#define PCA9685_RESTART 0x80 // MODE1: restart PWM channels after sleep
+#define PCA9685_AI 0x20      // MODE1: register auto-increment
+#define PCA9685_SLEEP 0x10   // MODE1: oscillator off
+#define PCA9685_ALLCALL 0x01 // MODE1: respond to the ALLCALL address
+#define PCA9685_MODE2 0x1
+#define PCA9685_OUTDRV 0x4 // MODE2: totem pole outputs
+#define PCA9685_OCH 0x8    // MODE2: outputs change on ACK instead of STOP
+#define PCA9685_PRESCALE 0xFE
+
 volatile sig_atomic_t adafruit_motorshield_internal_done = 0;
 
 void sigHandler(int sig)
 {
     adafruit_motorshield_internal_done = 1;
 }
+
+static inline uint64_t get_timestamp()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000000LLU + ts.tv_nsec);
+}
 #endif // _DOXYGEN_
 
 namespace Adafruit
 {
+#ifndef _DOXYGEN_
     /**
-     * @brief Sinusoidal microstepping curve (sine curve between 0 and pi/2)
-     * for the PWM output (12-bit range), with n + 1 points (in this case, n = 8).
-     * The last point is the beginning of the next step.
-     *
-     */
-    static uint16_t microstepcurve8[] = {0, 798, 1567, 2275, 2895,
-                                         3404, 3783, 4016, 4095};
-
-    /**
-     * @brief Microstep curve for n = 16.
-     *
-     */
-    static uint16_t microstepcurve16[] = {0, 401, 798, 1188, 1567, 1930, 2275, 2597, 2895, 3165, 3404,
-                                          3611, 3783, 3918, 4016, 4075, 4095};
-
-    /**
-     * @brief Microstep curve for n = 32.
-     *
-     */
-    static uint16_t microstepcurve32[] = {0, 200, 401, 600, 798, 995, 1188, 1379, 1567, 1750, 1930,
-                                          2105, 2275, 2439, 2597, 2750, 2895, 3034, 3165, 3289, 3404, 3512,
-                                          3611, 3701, 3783, 3855, 3918, 3972, 4016, 4050, 4075, 4090, 4095};
-
-    /**
-     * @brief Microstep curve for n = 64.
+     * @brief Shields sharing an I2C bus, with the bus' ALLCALL device and start gate.
      *
      */
-    static uint16_t microstepcurve64[] = {0, 100, 200, 301, 401, 501, 600, 700, 798, 897, 995,
-                                          1092, 1188, 1284, 1379, 1473, 1567, 1659, 1750, 1841, 1930, 2018,
-                                          2105, 2190, 2275, 2357, 2439, 2519, 2597, 2674, 2750, 2823, 2895,
-                                          2965, 3034, 3100, 3165, 3228, 3289, 3348, 3404, 3459, 3512, 3563,
-                                          3611, 3657, 3701, 3743, 3783, 3820, 3855, 3888, 3918, 3946, 3972,
-                                          3995, 4016, 4034, 4050, 4064, 4075, 4083, 4090, 4093, 4095};
+    struct ShieldBus
+    {
+        int id;
+        i2cbus allcall[1];
+        bool allcall_open;
+        std::vector<MotorShield *> shields;
+        std::mutex gate_lock;
+        bool armed;
+        uint64_t start_at; // CLOCK_MONOTONIC time of the last allStart
+        uint64_t stop_latency;
+    };
+
+    static std::mutex shieldbus_lock; // guards shieldbuses and their shield lists
+    static std::vector<ShieldBus *> shieldbuses;
+
+    static ShieldBus *findShieldBus(int id)
+    {
+        for (auto sb : shieldbuses)
+            if (sb->id == id)
+                return sb;
+        return nullptr;
+    }
 
-    /**
-     * @brief Microstep curve for n = 128.
-     *
-     */
-    static uint16_t microstepcurve128[] = {0, 50, 100, 150, 200, 251, 301, 351, 401, 451, 501,
-                                           551, 600, 650, 700, 749, 798, 848, 897, 946, 995, 1043,
-                                           1092, 1140, 1188, 1236, 1284, 1332, 1379, 1426, 1473, 1520, 1567,
-                                           1613, 1659, 1705, 1750, 1796, 1841, 1885, 1930, 1974, 2018, 2061,
-                                           2105, 2148, 2190, 2233, 2275, 2316, 2357, 2398, 2439, 2479, 2519,
-                                           2558, 2597, 2636, 2674, 2712, 2750, 2787, 2823, 2859, 2895, 2930,
-                                           2965, 3000, 3034, 3067, 3100, 3133, 3165, 3197, 3228, 3258, 3289,
-                                           3318, 3348, 3376, 3404, 3432, 3459, 3486, 3512, 3537, 3563, 3587,
-                                           3611, 3634, 3657, 3680, 3701, 3723, 3743, 3763, 3783, 3802, 3820,
-                                           3838, 3855, 3872, 3888, 3903, 3918, 3932, 3946, 3959, 3972, 3984,
-                                           3995, 4006, 4016, 4025, 4034, 4042, 4050, 4057, 4064, 4070, 4075,
-                                           4079, 4083, 4087, 4090, 4092, 4093, 4094, 4095};
+    static thread_local i2cbus_prio bus_class = I2CBUS_PRIO_HOUSEKEEPING; // priority of the transfers of this thread
 
-    /**
-     * @brief Microstep curve for n = 256.
-     *
-     */
-    static uint16_t microstepcurve256[] = {
-        0, 25, 50, 75, 100, 125, 150, 175, 200, 226, 251,
-        276, 301, 326, 351, 376, 401, 426, 451, 476, 501, 526,
-        551, 575, 600, 625, 650, 675, 700, 724, 749, 774, 798,
-        823, 848, 872, 897, 921, 946, 970, 995, 1019, 1043, 1067,
-        1092, 1116, 1140, 1164, 1188, 1212, 1236, 1260, 1284, 1308, 1332,
-        1355, 1379, 1403, 1426, 1450, 1473, 1497, 1520, 1543, 1567, 1590,
-        1613, 1636, 1659, 1682, 1705, 1728, 1750, 1773, 1796, 1818, 1841,
-        1863, 1885, 1908, 1930, 1952, 1974, 1996, 2018, 2040, 2061, 2083,
-        2105, 2126, 2148, 2169, 2190, 2212, 2233, 2254, 2275, 2295, 2316,
-        2337, 2357, 2378, 2398, 2419, 2439, 2459, 2479, 2499, 2519, 2539,
-        2558, 2578, 2597, 2617, 2636, 2655, 2674, 2693, 2712, 2731, 2750,
-        2768, 2787, 2805, 2823, 2841, 2859, 2877, 2895, 2913, 2930, 2948,
-        2965, 2983, 3000, 3017, 3034, 3051, 3067, 3084, 3100, 3117, 3133,
-        3149, 3165, 3181, 3197, 3212, 3228, 3243, 3258, 3274, 3289, 3304,
-        3318, 3333, 3348, 3362, 3376, 3390, 3404, 3418, 3432, 3446, 3459,
-        3473, 3486, 3499, 3512, 3525, 3537, 3550, 3563, 3575, 3587, 3599,
-        3611, 3623, 3634, 3646, 3657, 3668, 3680, 3691, 3701, 3712, 3723,
-        3733, 3743, 3753, 3763, 3773, 3783, 3792, 3802, 3811, 3820, 3829,
-        3838, 3847, 3855, 3864, 3872, 3880, 3888, 3896, 3903, 3911, 3918,
-        3925, 3932, 3939, 3946, 3953, 3959, 3966, 3972, 3978, 3984, 3989,
-        3995, 4000, 4006, 4011, 4016, 4021, 4025, 4030, 4034, 4038, 4042,
-        4046, 4050, 4054, 4057, 4061, 4064, 4067, 4070, 4072, 4075, 4077,
-        4079, 4081, 4083, 4085, 4087, 4088, 4090, 4091, 4092, 4093, 4093,
-        4094, 4094, 4094, 4095};
+    // through the worker of the bus if it has one, in this thread otherwise
+    static int busTransfer(i2cbus *dev, i2cbus_msg *msgs, int n)
+    {
+        i2cbus_req req;
+        req.dev = dev;
+        req.msgs = msgs;
+        req.n = n;
+        req.prio = bus_class;
+        req.cb = nullptr;
+        req.user = nullptr;
+        if (i2cbus_submit(&req) < 0)
+            return -1;
+        return i2cbus_req_wait(&req, -1);
+    }
+#endif // _DOXYGEN_
 
-    /**
-     * @brief Microstep curve for n = 512.
-     *
-     */
-    static uint16_t microstepcurve512[] = {
-        0, 12, 25, 37, 50, 62, 75, 87, 100, 113, 125,
-        138, 150, 163, 175, 188, 200, 213, 226, 238, 251, 263,
-        276, 288, 301, 313, 326, 338, 351, 363, 376, 388, 401,
-        413, 426, 438, 451, 463, 476, 488, 501, 513, 526, 538,
-        551, 563, 575, 588, 600, 613, 625, 638, 650, 662, 675,
-        687, 700, 712, 724, 737, 749, 761, 774, 786, 798, 811,
-        823, 835, 848, 860, 872, 884, 897, 909, 921, 933, 946,
-        958, 970, 982, 995, 1007, 1019, 1031, 1043, 1055, 1067, 1080,
-        1092, 1104, 1116, 1128, 1140, 1152, 1164, 1176, 1188, 1200, 1212,
-        1224, 1236, 1248, 1260, 1272, 1284, 1296, 1308, 1320, 1332, 1344,
-        1355, 1367, 1379, 1391, 1403, 1414, 1426, 1438, 1450, 1462, 1473,
-        1485, 1497, 1508, 1520, 1532, 1543, 1555, 1567, 1578, 1590, 1601,
-        1613, 1624, 1636, 1647, 1659, 1670, 1682, 1693, 1705, 1716, 1728,
-        1739, 1750, 1762, 1773, 1784, 1796, 1807, 1818, 1829, 1841, 1852,
-        1863, 1874, 1885, 1897, 1908, 1919, 1930, 1941, 1952, 1963, 1974,
-        1985, 1996, 2007, 2018, 2029, 2040, 2051, 2061, 2072, 2083, 2094,
-        2105, 2116, 2126, 2137, 2148, 2158, 2169, 2180, 2190, 2201, 2212,
-        2222, 2233, 2243, 2254, 2264, 2275, 2285, 2295, 2306, 2316, 2327,
-        2337, 2347, 2357, 2368, 2378, 2388, 2398, 2409, 2419, 2429, 2439,
-        2449, 2459, 2469, 2479, 2489, 2499, 2509, 2519, 2529, 2539, 2548,
-        2558, 2568, 2578, 2588, 2597, 2607, 2617, 2626, 2636, 2646, 2655,
-        2665, 2674, 2684, 2693, 2703, 2712, 2721, 2731, 2740, 2750, 2759,
-        2768, 2777, 2787, 2796, 2805, 2814, 2823, 2832, 2841, 2850, 2859,
-        2868, 2877, 2886, 2895, 2904, 2913, 2922, 2930, 2939, 2948, 2957,
-        2965, 2974, 2983, 2991, 3000, 3008, 3017, 3025, 3034, 3042, 3051,
-        3059, 3067, 3076, 3084, 3092, 3100, 3108, 3117, 3125, 3133, 3141,
-        3149, 3157, 3165, 3173, 3181, 3189, 3197, 3204, 3212, 3220, 3228,
-        3235, 3243, 3251, 3258, 3266, 3274, 3281, 3289, 3296, 3304, 3311,
-        3318, 3326, 3333, 3340, 3348, 3355, 3362, 3369, 3376, 3383, 3390,
-        3397, 3404, 3411, 3418, 3425, 3432, 3439, 3446, 3452, 3459, 3466,
-        3473, 3479, 3486, 3492, 3499, 3505, 3512, 3518, 3525, 3531, 3537,
-        3544, 3550, 3556, 3563, 3569, 3575, 3581, 3587, 3593, 3599, 3605,
-        3611, 3617, 3623, 3629, 3634, 3640, 3646, 3652, 3657, 3663, 3668,
-        3674, 3680, 3685, 3691, 3696, 3701, 3707, 3712, 3717, 3723, 3728,
-        3733, 3738, 3743, 3748, 3753, 3758, 3763, 3768, 3773, 3778, 3783,
-        3788, 3792, 3797, 3802, 3806, 3811, 3816, 3820, 3825, 3829, 3834,
-        3838, 3842, 3847, 3851, 3855, 3859, 3864, 3868, 3872, 3876, 3880,
-        3884, 3888, 3892, 3896, 3899, 3903, 3907, 3911, 3915, 3918, 3922,
-        3925, 3929, 3932, 3936, 3939, 3943, 3946, 3949, 3953, 3956, 3959,
-        3962, 3966, 3969, 3972, 3975, 3978, 3981, 3984, 3987, 3989, 3992,
-        3995, 3998, 4000, 4003, 4006, 4008, 4011, 4013, 4016, 4018, 4021,
-        4023, 4025, 4028, 4030, 4032, 4034, 4036, 4038, 4040, 4042, 4044,
-        4046, 4048, 4050, 4052, 4054, 4056, 4057, 4059, 4061, 4062, 4064,
-        4065, 4067, 4068, 4070, 4071, 4072, 4074, 4075, 4076, 4077, 4078,
-        4079, 4080, 4081, 4082, 4083, 4084, 4085, 4086, 4087, 4088, 4088,
-        4089, 4090, 4090, 4091, 4091, 4092, 4092, 4093, 4093, 4093, 4094,
-        4094, 4094, 4094, 4094, 4094, 4094, 4095};
-
-    MotorShield::MotorShield(uint8_t addr, int bus)
+    MotorShield::MotorShield(uint8_t addr, int bus, bool shared_fd) : engine(this)
     {
         _addr = addr;
         _bus = bus;
+        _shared = shared_fd;
         initd = false;
+        shadow_valid = 0;
+        writes_issued = writes_elided = 0;
+        txn_depth = 0;
+        txn_dirty = 0;
+        sbus = nullptr;
+        memset(this->bus, 0, sizeof(this->bus));
         signal(SIGINT, sigHandler);
     }
 
     MotorShield::~MotorShield()
     {
+        engine.shutdown();
         for (int i = 0; i < 4; i++)
             if (dcmotors[i].initd)
                 dcmotors[i].fullOff();
         for (int i = 0; i < 2; i++)
             if (steppers[i].initd)
                 steppers[i].release();
-        i2cbus_close(bus);
+        if (sbus != nullptr)
+        {
+            std::lock_guard<std::mutex> lock(shieldbus_lock);
+            sbus->shields.erase(std::find(sbus->shields.begin(), sbus->shields.end(), this));
+            if (sbus->shields.empty())
+            {
+                if (sbus->allcall_open)
+                    i2cbus_close(sbus->allcall);
+                shieldbuses.erase(std::find(shieldbuses.begin(), shieldbuses.end(), sbus));
+                delete sbus;
+            }
+        }
+        if (bus->bus != nullptr)
+            i2cbus_close(bus);
     }
 
     bool _Catchable MotorShield::begin(uint16_t freq)
     {
-        if (i2cbus_open(bus, _bus, _addr) < 0)
+        uint64_t t0 = get_timestamp();
+        memset(&startup, 0, sizeof(startup));
+        if (bus->bus == nullptr && (_shared ? i2cbus_open_shared(bus, _bus, _addr) : i2cbus_open(bus, _bus, _addr)) < 0) // a second begin() keeps the device
         {
             dbprintlf("Error opening I2C bus %d", _bus);
             throw std::runtime_error("Could not open device " + std::to_string(_addr) + " on bus " + std::to_string(_bus));
         }
+        uint64_t t1 = get_timestamp();
         bool status = true;
-        status &= reset();
+        invalidateShadow();
+        uint8_t mode1 = 0, prescale_now = 0;
+        if (!readRegs(PCA9685_MODE1, &mode1, 1) || !readRegs(PCA9685_PRESCALE, &prescale_now, 1))
+        {
+            dbprintlf("Error reading MODE1/PRESCALE");
+            status = false;
+        }
+        // OCH cleared: every channel written in one transaction latches on its STOP condition
+        status &= write8(PCA9685_MODE2, PCA9685_OUTDRV);
+        uint64_t t2 = get_timestamp();
         _freq = freq;
-        status &= setPWMFreq(_freq); // This is the maximum PWM frequency
-        for (uint8_t i = 0; i < 16; i++)
-            status &= setPWM(i, 0, 0);
+        if (status) // MODE1/PRESCALE contents are needed to skip the sleep cycle
+            status &= setPWMFreq(_freq, mode1, prescale_now); // This is the maximum PWM frequency
+        uint64_t t3 = get_timestamp();
+        status &= clearAll();
+        uint64_t t4 = get_timestamp();
+        startup.open = t1 - t0;
+        startup.mode = t2 - t1;
+        startup.prescale = t3 - t2;
+        startup.clear = t4 - t3;
+        startup.total = t4 - t0;
         initd = status;
+        if (initd && sbus == nullptr)
+        {
+            std::lock_guard<std::mutex> lock(shieldbus_lock);
+            sbus = findShieldBus(_bus);
+            if (sbus == nullptr)
+            {
+                sbus = new ShieldBus();
+                sbus->id = _bus;
+                sbus->armed = false;
+                sbus->start_at = 0;
+                sbus->stop_latency = 0;
+                // ALLCALL is enabled in MODE1 by setPWMFreq, ALLCALLADR defaults to 0x70
+                sbus->allcall_open = (_shared ? i2cbus_open_shared(sbus->allcall, _bus, PCA9685_ALLCALL_ADDR) : i2cbus_open(sbus->allcall, _bus, PCA9685_ALLCALL_ADDR)) >= 0;
+                if (!sbus->allcall_open)
+                    dbprintlf("Could not open ALLCALL address 0x%02x on bus %d, broadcasts disabled", PCA9685_ALLCALL_ADDR, _bus);
+                shieldbuses.push_back(sbus);
+            }
+            sbus->shields.push_back(this);
+        }
+        if (initd)
+            engine.start();
         return status;
     }
 
@@ -243,6 +254,167 @@ namespace Adafruit
         return false;
     }
 
+    void MotorShield::invalidateShadow()
+    {
+        std::lock_guard<std::recursive_mutex> lock(regs);
+        shadow_valid = 0;
+    }
+
+    void MotorShield::beginTransaction()
+    {
+        regs.lock();
+        txn_depth++;
+    }
+
+    bool MotorShield::commit()
+    {
+        bool status = true;
+        std::lock_guard<std::recursive_mutex> lock(regs); // re-entrant for the thread that began the transaction
+        if (txn_depth == 0)
+        {
+            dbprintlf("commit() without beginTransaction()");
+            return false;
+        }
+        if (--txn_depth == 0)
+            status = flushTransaction();
+        regs.unlock(); // the lock taken in beginTransaction()
+        return status;
+    }
+
+    bool MotorShield::commitGroup(const std::vector<MotorShield *> &shields)
+    {
+        if (shields.empty())
+            return true;
+        bool status = true;
+        std::vector<MotorShield *> group; // shields whose outermost transaction ends here
+        std::vector<ChannelRuns> runs;
+        for (auto sh : shields)
+        {
+            if (sh->_bus != shields[0]->_bus)
+            {
+                status &= sh->commit();
+                continue;
+            }
+            std::lock_guard<std::recursive_mutex> lock(sh->regs);
+            if (sh->txn_depth == 0)
+            {
+                dbprintlf("commitGroup() on shield 0x%02x without beginTransaction()", sh->_addr);
+                status = false;
+                continue;
+            }
+            if (--sh->txn_depth == 0)
+            {
+                group.push_back(sh);
+                runs.emplace_back();
+                sh->stageRuns(runs.back());
+            }
+            else
+                sh->regs.unlock(); // the lock taken in beginTransaction()
+        }
+        // messages carry the slave address, the transfer can go through any shield of the bus
+        std::vector<uint8_t> buf(group.size() * (8 + 4 * 16));
+        std::vector<i2cbus_msg> msgs(group.size() * 8);
+        std::vector<size_t> at(group.size() + 1, 0);
+        for (size_t i = 0; i < group.size(); i++)
+            at[i + 1] = at[i] + group[i]->packRuns(runs[i], &buf[i * (8 + 4 * 16)], &msgs[at[i]]);
+        // a transfer carries up to I2CBUS_BATCH_MAX messages: a larger group is split between
+        // shields, so that each shield still switches all of its channels on one STOP
+        for (size_t lo = 0, hi; lo < group.size(); lo = hi)
+        {
+            for (hi = lo + 1; hi < group.size() && at[hi + 1] - at[lo] <= I2CBUS_BATCH_MAX; hi++)
+                ;
+            int n = at[hi] - at[lo];
+            int counter = 10;
+            bool failed = n > 0;
+            while (failed && counter--)
+            {
+                failed = busTransfer(group[0]->bus, &msgs[at[lo]], n) != n;
+            }
+        }
+        for (size_t i = 0; i < group.size(); i++)
+        {
+            bool ok = true;
+            for (size_t k = at[i]; k < at[i + 1]; k++)
+                ok &= msgs[k].status == msgs[k].len;
+            group[i]->runsWritten(runs[i], ok);
+            status &= ok;
+            group[i]->regs.unlock(); // the lock taken in beginTransaction()
+        }
+        return status;
+    }
+
+    bool MotorShield::readChannels(uint16_t on[16], uint16_t off[16])
+    {
+        if (!initd)
+        {
+            bprintlf("MotorShield object not initialized, please invoke begin().");
+            return false;
+        }
+        uint8_t buf[4 * 16];
+        if (!readRegs(LED0_ON_L, buf, sizeof(buf)))
+            return false;
+        for (uint8_t i = 0; i < 16; i++)
+        {
+            on[i] = buf[4 * i] | (buf[4 * i + 1] << 8);
+            off[i] = buf[4 * i + 2] | (buf[4 * i + 3] << 8);
+        }
+        return true;
+    }
+
+    uint64_t MotorShield::getWritesIssued() const
+    {
+        std::lock_guard<std::recursive_mutex> lock(regs);
+        return writes_issued;
+    }
+
+    ShieldStartupTiming MotorShield::getStartupTiming() const
+    {
+        return startup;
+    }
+
+    bool MotorShield::setRealtime(const RealtimeConfig &cfg)
+    {
+        return engine.configure(cfg);
+    }
+
+    RealtimeConfig MotorShield::getRealtime() const
+    {
+        return engine.realtime();
+    }
+
+    uint64_t MotorShield::getWritesElided() const
+    {
+        std::lock_guard<std::recursive_mutex> lock(regs);
+        return writes_elided;
+    }
+
+    bool MotorShield::onestepBoth(MotorDir dir1, MotorDir dir2, MotorStyle style)
+    {
+        if (!initd)
+        {
+            bprintlf("MotorShield object not initialized, please invoke begin().");
+            return false;
+        }
+        if (style < SINGLE || style > MICROSTEP)
+        {
+            dbprintlf("Stepping style %u unknown", style);
+            return false;
+        }
+        // both frames go out in one commit, a held port is not staged and stays as it is
+        beginTransaction();
+        MotorDir dir[2] = {dir1, dir2};
+        for (int i = 0; i < 2; i++)
+        {
+            StepperMotor *mot = &steppers[i];
+            if (!mot->initd || (dir[i] != FORWARD && dir[i] != BACKWARD))
+                continue;
+            uint16_t on[FRAME_CHANNELS], off[FRAME_CHANNELS];
+            stepFrame(mot->advance(dir[i], style), on, off);
+            setPWMBurst(mot->FRAMEpin, FRAME_CHANNELS, on, off);
+        }
+        return commit();
+    }
+
     DCMotor *MotorShield::getMotor(uint8_t num)
     {
         if (!initd)
@@ -316,32 +488,13 @@ namespace Adafruit
             steppers[port].initd = true;
             steppers[port].revsteps = steps;
             steppers[port].MC = this;
-            steppers[port].microsteps = microsteps;
-            switch (microsteps)
+            if (stepPhaseFn(MICROSTEP, microsteps) == nullptr)
             {
-#ifndef _DOXYGEN_
-#define MCASE(x)                                           \
-    case (STEP##x):                                        \
-        steppers[port].microsteps = STEP##x;               \
-        steppers[port].microstepcurve = microstepcurve##x; \
-        break;
-#endif // _DOXYGEN_
-
-                MCASE(8)
-                MCASE(16)
-                MCASE(32)
-                MCASE(64)
-                MCASE(128)
-                MCASE(256)
-                MCASE(512)
-#undef MCASE
-
-            default:
-                dbprintlf("Microsteps %u not valid, setting microsteps to %u", (uint8_t)microsteps, (uint8_t)STEP16);
-                steppers[port].microsteps = STEP16;
-                steppers[port].microstepcurve = microstepcurve16;
-                break;
+                dbprintlf("Microsteps %u not valid, setting microsteps to %u", (uint16_t)microsteps, (uint16_t)STEP16);
+                microsteps = STEP16;
             }
+            steppers[port].microsteps = microsteps;
+            steppers[port].loadPhaseFns();
             uint8_t pwma = 8, pwmb = 13, ain1 = 9, ain2 = 10, bin1 = 11, bin2 = 12;
             if (port == 0)
             {
@@ -367,6 +520,7 @@ namespace Adafruit
             steppers[port].AIN2pin = ain2;
             steppers[port].BIN1pin = bin1;
             steppers[port].BIN2pin = bin2;
+            steppers[port].FRAMEpin = std::min({pwma, pwmb, ain1, ain2, bin1, bin2});
         }
         return &steppers[port];
     }
@@ -383,14 +537,15 @@ namespace Adafruit
 
     void DCMotor::run(MotorDir cmd)
     {
+        MC->beginTransaction(); // both pins latch together, no 'break' or shoot-through in between
         switch (cmd)
         {
         case FORWARD:
-            MC->setPin(IN2pin, LOW); // take low first to avoid 'break'
+            MC->setPin(IN2pin, LOW);
             MC->setPin(IN1pin, HIGH);
             break;
         case BACKWARD:
-            MC->setPin(IN1pin, LOW); // take low first to avoid 'break'
+            MC->setPin(IN1pin, LOW);
             MC->setPin(IN2pin, HIGH);
             break;
         case RELEASE:
@@ -404,6 +559,7 @@ namespace Adafruit
             dbprintlf("Direction %u unknown", cmd);
             break;
         }
+        MC->commit();
     }
 
     void DCMotor::setSpeed(uint8_t speed)
@@ -435,412 +591,569 @@ namespace Adafruit
     StepperMotor::StepperMotor(void)
     {
         revsteps = currentstep = 0;
+        position = 0;
+        speed_req = 0;
         MC = nullptr;
         microsteps = STEP16;
         initd = false;
-        microstepcurve = microstepcurve16;
+        loadPhaseFns();
         done = &adafruit_motorshield_internal_done;
         usperstep = 0;
-        stop = false;
-        moving = false;
+        stop_seq = off_seq = 0;
+        profile = CONSTANT;
+        accel_rpms = jerk_rpms2 = start_rpm = 0;
+        hybrid_steps = 1;
+        hybrid_rpm = 0;
+        late_policy = LATE_CATCHUP;
+        catchup = 0;
+        missed_ticks = 0;
+        trace_head = trace_count = 0;
+        for (int i = 0; i < MICROSTEP; i++)
+        {
+            io_ns[i] = 0;
+            io_ticks[i] = 0;
+        }
+        rate_style = SINGLE;
+        rate_first = rate_last = 0;
+        rate_steps = 0;
     }
 
     void StepperMotor::release(void)
     {
+        MC->beginTransaction();
         MC->setPin(AIN1pin, LOW);
         MC->setPin(AIN2pin, LOW);
         MC->setPin(BIN1pin, LOW);
         MC->setPin(BIN2pin, LOW);
         MC->setPWM(PWMApin, 0);
         MC->setPWM(PWMBpin, 0);
+        MC->commit();
     }
 
     bool _Catchable StepperMotor::setSpeed(double rpm)
     {
         if (rpm <= 0)
             throw std::runtime_error("Motor speed can not be negative or zero.");
-        std::unique_lock<std::mutex> lock(cs, std::try_to_lock);
-        if (lock.owns_lock())
+        std::lock_guard<std::mutex> lock(cs);
+        usperstep = 60000000ULL / ((uint32_t)revsteps * rpm);
+        if (queue.outstanding() && MC)
         {
-            usperstep = 60000000ULL / ((uint32_t)revsteps * rpm);
-            return true;
+            // the engine retargets the running and queued moves at its next pass
+            speed_req.store(usperstep);
+            MC->engine.kick();
         }
-        return false;
+        return true;
     }
 
-    bool StepperMotor::setStep(MicroSteps microsteps)
+    bool _Catchable StepperMotor::setProfile(MotionProfile profile, double accel, double jerk, double start_rpm)
     {
-        std::unique_lock<std::mutex> lock(cs, std::try_to_lock);
-        if (lock.owns_lock())
+        if (profile != CONSTANT && accel <= 0)
+            throw std::runtime_error("Acceleration has to be positive for an accelerated profile.");
+        if (profile == SCURVE && jerk <= 0)
+            throw std::runtime_error("Jerk has to be positive for an S-curve profile.");
+        if (start_rpm < 0)
+            throw std::runtime_error("Start speed can not be negative.");
+        std::lock_guard<std::mutex> lock(cs);
+        if (queue.outstanding())
+            return false;
+        this->profile = profile;
+        accel_rpms = profile == CONSTANT ? 0 : accel;
+        jerk_rpms2 = profile == SCURVE ? jerk : 0;
+        this->start_rpm = start_rpm;
+        return true;
+    }
+
+    bool _Catchable StepperMotor::setHybrid(uint16_t fine_steps, double fine_rpm)
+    {
+        if (fine_rpm < 0)
+            throw std::runtime_error("Final approach speed can not be negative.");
+        std::lock_guard<std::mutex> lock(cs);
+        if (queue.outstanding())
+            return false;
+        hybrid_steps = fine_steps;
+        hybrid_rpm = fine_rpm;
+        return true;
+    }
+
+    bool _Catchable StepperMotor::setLatePolicy(LatePolicy policy, double catchup)
+    {
+        if (catchup != 0 && catchup < 1)
+            throw std::runtime_error("Catch-up rate can not be below the planned rate.");
+        std::lock_guard<std::mutex> lock(cs);
+        if (queue.outstanding())
+            return false;
+        late_policy = policy;
+        this->catchup = catchup;
+        return true;
+    }
+
+    uint64_t StepperMotor::getMissedTicks() const
+    {
+        return missed_ticks;
+    }
+
+    void StepperMotor::setTrace(size_t len)
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        trace.assign(len, 0);
+        trace_head = trace_count = 0;
+    }
+
+    size_t StepperMotor::getTrace(uint64_t *tstamps, size_t max)
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        size_t n = trace_count < max ? trace_count : max;
+        size_t first = trace_head + trace.size() - trace_count;
+        for (size_t i = 0; i < n; i++)
+            tstamps[i] = trace[(first + i) % trace.size()];
+        trace_head = trace_count = 0;
+        return n;
+    }
+
+    void StepperMotor::tickDone(uint64_t tstamp, uint64_t io, MotorStyle style, bool first)
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        // running mean over the last ~64 ticks, so it follows bus load
+        uint64_t n = ++io_ticks[style - 1];
+        io_ns[style - 1] += (io - io_ns[style - 1]) / (n < 64 ? n : 64);
+        if (first)
         {
-            switch (microsteps)
-            {
-#ifndef _DOXYGEN_
-#define MCASE(x)                            \
-    case (STEP##x):                         \
-        this->microsteps = STEP##x;         \
-        microstepcurve = microstepcurve##x; \
-        break;
-#endif // _DOXYGEN_
+            rate_style = style;
+            rate_first = tstamp;
+            rate_steps = 0;
+        }
+        else
+            rate_steps += 1 / ticksPerStep(style);
+        rate_last = tstamp;
+        if (trace.empty())
+            return;
+        trace[trace_head] = tstamp;
+        trace_head = (trace_head + 1) % trace.size();
+        if (trace_count < trace.size())
+            trace_count++;
+    }
 
-                MCASE(8)
-                MCASE(16)
-                MCASE(32)
-                MCASE(64)
-                MCASE(128)
-                MCASE(256)
-                MCASE(512)
-#undef MCASE
-
-            default:
-                dbprintlf("Microsteps %u not valid, setting microsteps to %u", (uint8_t)microsteps, (uint8_t)STEP16);
-                this->microsteps = STEP16;
-                microstepcurve = microstepcurve16;
-                break;
-            }
-            return true;
+    double StepperMotor::ticksPerStep(MotorStyle style) const
+    {
+        if (style == INTERLEAVE)
+            return 2;
+        if (style == MICROSTEP)
+            return microsteps;
+        return 1;
+    }
+
+    double StepperMotor::maxRPM(MotorStyle style) const
+    {
+        if (style == HYBRID)
+            style = DOUBLE;
+        if (style < SINGLE || style > MICROSTEP || io_ns[style - 1] <= 0 || revsteps == 0)
+            return 0;
+        return 60e9 / (io_ns[style - 1] * ticksPerStep(style) * revsteps);
+    }
+
+    double StepperMotor::getMaxRPM(MotorStyle style) const
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        return maxRPM(style);
+    }
+
+    StepperRate StepperMotor::getRate() const
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        StepperRate r;
+        r.style = rate_style;
+        r.commanded_rpm = usperstep && revsteps ? 60e6 / ((double)usperstep * revsteps) : 0;
+        r.achieved_rpm = rate_last > rate_first && revsteps ? rate_steps * 60e9 / ((rate_last - rate_first) * (double)revsteps) : 0;
+        r.max_rpm = maxRPM(rate_style);
+        r.io_us = io_ns[rate_style - 1] * 1e-3;
+        return r;
+    }
+
+    bool StepperMotor::setStep(MicroSteps microsteps)
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        if (queue.outstanding()) // the phase sequencers are in use by the engine
+            return false;
+        if (stepPhaseFn(MICROSTEP, microsteps) == nullptr)
+        {
+            dbprintlf("Microsteps %u not valid, setting microsteps to %u", (uint16_t)microsteps, (uint16_t)STEP16);
+            microsteps = STEP16;
         }
-        return false;
+        this->microsteps = microsteps;
+        loadPhaseFns();
+        io_ns[MICROSTEP - 1] = 0; // frame sizes differ between resolutions
+        io_ticks[MICROSTEP - 1] = 0;
+        return true;
     }
 
-    void _Catchable StepperMotor::step(uint16_t steps, MotorDir dir, MotorStyle style, bool blocking)
+    MoveHandle _Catchable StepperMotor::move(uint64_t steps, MotorDir dir, MotorStyle style, MoveCallback cb, void *user)
     {
         if (usperstep == 0)
             throw std::runtime_error("RPM has to be set before stepping the motor.");
-        if (blocking)
+        if (style < SINGLE || style > HYBRID)
+            throw std::runtime_error("Stepping style " + std::to_string(style) + " unknown.");
+        if ((style == MICROSTEP || style == HYBRID) && steps > UINT64_MAX / microsteps)
+            throw std::runtime_error("Move of " + std::to_string(steps) + " steps is too long at " + std::to_string(microsteps) + " microsteps per step.");
+        if (steps == 0 || !queue.reserve())
+            return MoveHandle();
+        StepperMove move;
+        move.dir = dir;
+        move.style = style;
+        move.msteps = microsteps;
+        move.steps = steps;
+        move.dwell = 0;
+        move.fine = 0;
+        move.v_fine = 0;
+        // ticks per full step
+        double tps = 1;
+        if (style == INTERLEAVE)
         {
-            std::unique_lock<std::mutex> lock(cs);
-            uint64_t uspers = usperstep;
-
-            if (style == INTERLEAVE)
-            {
-                uspers /= 2;
-            }
-            else if (style == MICROSTEP)
-            {
-                uspers /= microsteps;
-                steps *= microsteps;
-                dbprintlf("steps = %d", steps);
-            }
-            stop = false;
-            StepperMotorTimerData data = {this, steps, dir, style, microsteps};
-            clkgen_t clk = create_clk(uspers * 1000LLU, stepHandlerFn, &data);
-            if (cond.wait_for(lock, std::chrono::microseconds(steps * uspers)) == std::cv_status::timeout)
+            tps = 2;
+        }
+        else if (style == MICROSTEP)
+        {
+            tps = microsteps;
+            move.steps *= microsteps;
+            dbprintlf("steps = %" PRIu64, move.steps);
+        }
+        else if (style == HYBRID) // counted in microsteps, the speeds are those of the double coil part
+        {
+            move.steps *= microsteps;
+        }
+        {
+            std::lock_guard<std::mutex> lock(cs);
+            double rpm_to_tps = revsteps * tps / 60.0; // RPM -> ticks/s
+            move.v_cruise = 1e6 * tps / usperstep;
+            move.v_start = move.v_end = start_rpm * rpm_to_tps;
+            move.accel = accel_rpms * rpm_to_tps;
+            move.jerk = jerk_rpms2 * rpm_to_tps;
+            if (style == HYBRID)
             {
-                while (data.steps)
-                {
-                    usleep(uspers);
-                }
+                move.fine = (uint32_t)hybrid_steps * microsteps;
+                move.v_fine = hybrid_rpm > 0 ? hybrid_rpm * revsteps * microsteps / 60.0 : move.v_cruise * microsteps;
             }
-            destroy_clk(clk);
-            moving = false;
         }
-        else // non-blocking, spawn thread
+        uint64_t seq = queue.push(move, cb, user);
+        MC->engine.kick();
+        return MoveHandle(this, seq);
+    }
+
+    MoveHandle _Catchable StepperMotor::dwell(double ms, MoveCallback cb, void *user)
+    {
+        if (ms < 0)
+            throw std::runtime_error("Dwell time can not be negative.");
+        if (!queue.reserve())
+            return MoveHandle();
+        StepperMove move = {};
+        move.dwell = ms * 1e-3;
+        uint64_t seq = queue.push(move, cb, user);
+        MC->engine.kick();
+        return MoveHandle(this, seq);
+    }
+
+    void _Catchable StepperMotor::step(uint64_t steps, MotorDir dir, MotorStyle style, bool blocking)
+    {
+        MoveHandle h;
+        while (!(h = move(steps, dir, style)).valid())
         {
-            std::thread stepThread(stepThreadFn, this, steps, dir, style);
-            stepThread.detach();
+            if (steps == 0)
+                return;
+            // queue full: wait for a move to finish
+            std::unique_lock<std::mutex> lock(cs);
+            cond.wait(lock, [this]
+                      { return queue.outstanding() < STEPPER_QUEUE_LEN; });
         }
+        if (blocking)
+            h.wait();
+    }
+
+    size_t StepperMotor::queuedMoves() const
+    {
+        return queue.outstanding();
     }
 
     bool StepperMotor::isMoving() const
     {
-        return moving;
+        return queue.outstanding() > 0;
     }
 
     void StepperMotor::stopMotor()
     {
-        if (moving)
-            stop = true;
+        if (queue.outstanding())
+        {
+            stop_seq = queue.last(); // moves queued from now on still run
+            MC->engine.kick();
+        }
     }
 
     uint64_t _Catchable StepperMotor::getStepPeriod() const
     {
         if (usperstep == 0)
             throw std::runtime_error("RPM has to be set before stepping the motor.");
-        return usperstep;
+        std::lock_guard<std::mutex> lock(cs);
+        double max = maxRPM(rate_style);
+        uint64_t sustained = max > 0 ? llround(60e6 / (max * revsteps)) : 0;
+        return sustained > usperstep ? sustained : usperstep;
     }
 
-    uint8_t StepperMotor::onestep(MotorDir dir, MotorStyle style)
+    MoveHandle::MoveHandle()
     {
-        uint16_t ocrb, ocra;
+        mot = nullptr;
+        seq = 0;
+    }
 
-        ocra = ocrb = 4095;
+    MoveHandle::MoveHandle(StepperMotor *mot, uint64_t seq)
+    {
+        this->mot = mot;
+        this->seq = seq;
+    }
 
-        // next determine what sort of stepping procedure we're up to
-        if (style == SINGLE)
-        {
-            if ((currentstep / (microsteps / 2)) % 2)
-            { // we're at an odd step, weird
-                if (dir == FORWARD)
-                {
-                    currentstep += microsteps / 2;
-                }
-                else
-                {
-                    currentstep -= microsteps / 2;
-                }
-            }
-            else
-            { // go to the next even step
-                if (dir == FORWARD)
-                {
-                    currentstep += microsteps;
-                }
-                else
-                {
-                    currentstep -= microsteps;
-                }
-            }
-        }
-        else if (style == DOUBLE)
-        {
-            if (!(currentstep / (microsteps / 2) % 2))
-            { // we're at an even step, weird
-                if (dir == FORWARD)
-                {
-                    currentstep += microsteps / 2;
-                }
-                else
-                {
-                    currentstep -= microsteps / 2;
-                }
-            }
-            else
-            { // go to the next odd step
-                if (dir == FORWARD)
-                {
-                    currentstep += microsteps;
-                }
-                else
-                {
-                    currentstep -= microsteps;
-                }
-            }
-        }
-        else if (style == INTERLEAVE)
-        {
-            if (dir == FORWARD)
-            {
-                currentstep += microsteps / 2;
-            }
-            else
-            {
-                currentstep -= microsteps / 2;
-            }
-        }
+    bool MoveHandle::valid() const
+    {
+        return mot != nullptr;
+    }
 
-        if (style == MICROSTEP)
-        {
-            if (dir == FORWARD)
-            {
-                currentstep++;
-            }
-            else
-            {
-                // BACKWARDS
-                currentstep--;
-            }
+    uint64_t MoveHandle::id() const
+    {
+        return seq;
+    }
 
-            currentstep += microsteps * 4;
-            currentstep %= microsteps * 4;
+    MoveResult MoveHandle::result() const
+    {
+        if (mot == nullptr)
+            return MOVE_INVALID;
+        const MoveStatus &st = mot->queue.slot(seq);
+        // result first: if the slot still belongs to this move afterwards, the result was this move's
+        MoveResult res = (MoveResult)st.result.load();
+        if (st.seq.load() != seq)
+            return MOVE_EXPIRED;
+        return res;
+    }
 
-            ocra = ocrb = 0;
-            if (currentstep < microsteps)
-            {
-                ocra = microstepcurve[microsteps - currentstep];
-                ocrb = microstepcurve[currentstep];
-            }
-            else if ((currentstep >= microsteps) && (currentstep < microsteps * 2))
-            {
-                ocra = microstepcurve[currentstep - microsteps];
-                ocrb = microstepcurve[microsteps * 2 - currentstep];
-            }
-            else if ((currentstep >= microsteps * 2) &&
-                     (currentstep < microsteps * 3))
-            {
-                ocra = microstepcurve[microsteps * 3 - currentstep];
-                ocrb = microstepcurve[currentstep - microsteps * 2];
-            }
-            else if ((currentstep >= microsteps * 3) &&
-                     (currentstep < microsteps * 4))
-            {
-                ocra = microstepcurve[currentstep - microsteps * 3];
-                ocrb = microstepcurve[microsteps * 4 - currentstep];
-            }
+    bool MoveHandle::done() const
+    {
+        MoveResult res = result();
+        return res == MOVE_DONE || res == MOVE_ABORTED || res == MOVE_EXPIRED;
+    }
+
+    bool MoveHandle::wait(int timeout_ms) const
+    {
+        if (mot == nullptr)
+            return false;
+        std::unique_lock<std::mutex> lock(mot->cs);
+        if (timeout_ms < 0)
+        {
+            mot->cond.wait(lock, [this]
+                           { return done(); });
+            return true;
         }
+        return mot->cond.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this]
+                                  { return done(); });
+    }
+
+    void StepperMotor::loadPhaseFns()
+    {
+        for (uint8_t st = SINGLE; st <= MICROSTEP; st++)
+            phasefn[st - 1] = stepPhaseFn((MotorStyle)st, microsteps);
+    }
 
-        currentstep += microsteps * 4;
-        currentstep %= microsteps * 4;
+    StepPhase StepperMotor::advance(MotorDir dir, MotorStyle style)
+    {
+        // phase advance and phase -> outputs mapping come from the compile-time tables
+        uint16_t prev = currentstep;
+        StepPhase ph = phasefn[style - 1](currentstep, dir);
+        // signed phase change, no style moves the phase by half an electrical cycle or more
+        int cycle = 4 * microsteps;
+        int delta = (currentstep - prev) & (cycle - 1);
+        if (delta > cycle / 2)
+            delta -= cycle;
+        position.fetch_add(delta * (MICROSTEP_MAX / microsteps), std::memory_order_relaxed);
+        return ph;
+    }
 
-        dbprintlf("current step: %u, pwmA = %u, pwmB = %u", currentstep, ocra, ocrb);
-        MC->setPWM(PWMApin, ocra);
-        MC->setPWM(PWMBpin, ocrb);
+    int64_t StepperMotor::getPosition() const
+    {
+        int64_t unit = MICROSTEP_MAX / microsteps;
+        int64_t pos = position.load(std::memory_order_relaxed);
+        return pos >= 0 ? pos / unit : -((-pos + unit - 1) / unit); // rounded down
+    }
 
-        // release all
-        uint8_t latch_state = 0; // all motor pins to 0
+    double StepperMotor::getPositionSteps() const
+    {
+        return position.load(std::memory_order_relaxed) / (double)MICROSTEP_MAX;
+    }
 
-        if (style == MICROSTEP)
-        {
-            if (currentstep < microsteps)
-                latch_state |= 0x03;
-            if ((currentstep >= microsteps) && (currentstep < microsteps * 2))
-                latch_state |= 0x06;
-            if ((currentstep >= microsteps * 2) && (currentstep < microsteps * 3))
-                latch_state |= 0x0C;
-            if ((currentstep >= microsteps * 3) && (currentstep < microsteps * 4))
-                latch_state |= 0x09;
-        }
-        else
-        {
-            switch (currentstep / (microsteps / 2))
-            {
-            case 0:
-                latch_state |= 0x1; // energize coil 1 only
-                break;
-            case 1:
-                latch_state |= 0x3; // energize coil 1+2
-                break;
-            case 2:
-                latch_state |= 0x2; // energize coil 2 only
-                break;
-            case 3:
-                latch_state |= 0x6; // energize coil 2+3
-                break;
-            case 4:
-                latch_state |= 0x4; // energize coil 3 only
-                break;
-            case 5:
-                latch_state |= 0xC; // energize coil 3+4
-                break;
-            case 6:
-                latch_state |= 0x8; // energize coil 4 only
-                break;
-            case 7:
-                latch_state |= 0x9; // energize coil 1+4
-                break;
-            }
-        }
-        dbprintlf("Latch: 0x%02x", latch_state);
+    bool StepperMotor::setPosition(int64_t microsteps)
+    {
+        std::lock_guard<std::mutex> lock(cs);
+        if (queue.outstanding())
+            return false;
+        position.store(microsteps * (MICROSTEP_MAX / this->microsteps), std::memory_order_relaxed);
+        return true;
+    }
 
-        if (latch_state & 0x1)
-        {
-            MC->setPin(AIN2pin, HIGH);
-        }
-        else
-        {
-            MC->setPin(AIN2pin, LOW);
-        }
-        if (latch_state & 0x2)
-        {
-            MC->setPin(BIN1pin, HIGH);
-        }
-        else
-        {
-            MC->setPin(BIN1pin, LOW);
-        }
-        if (latch_state & 0x4)
-        {
-            MC->setPin(AIN1pin, HIGH);
-        }
-        else
-        {
-            MC->setPin(AIN1pin, LOW);
-        }
-        if (latch_state & 0x8)
-        {
-            MC->setPin(BIN2pin, HIGH);
-        }
-        else
+    uint16_t StepperMotor::onestep(MotorDir dir, MotorStyle style)
+    {
+        if (style < SINGLE || style > MICROSTEP)
         {
-            MC->setPin(BIN2pin, LOW);
+            dbprintlf("Stepping style %u unknown", style);
+            return currentstep;
         }
+        uint16_t on[FRAME_CHANNELS], off[FRAME_CHANNELS];
+        stepFrame(advance(dir, style), on, off);
+        MC->setPWMBurst(FRAMEpin, FRAME_CHANNELS, on, off);
 
         return currentstep;
     }
 
-    void StepperMotor::stepHandlerFn(clkgen_t clk, void *data_)
+    /*************** Steppers **************/
+    /***************************************/
+
+    /************** MotorShield Broadcast *************/
+    /**************************************************/
+
+    bool MotorShield::allOff(int bus)
     {
-        struct StepperMotorTimerData *data = (struct StepperMotorTimerData *)data_;
-        StepperMotor *_this = data->_this;
-        // if at odd microstep we HAVE to step until we reach an integral step
-        if ((data->steps % data->msteps) && (data->style == MotorStyle::MICROSTEP))
+        uint64_t start = get_timestamp();
+        std::lock_guard<std::mutex> lock(shieldbus_lock);
+        ShieldBus *sb = findShieldBus(bus);
+        if (sb == nullptr)
         {
-            _this->moving = true;
-            _this->onestep(data->dir, data->style);
-            data->steps--;
-            return; // can not let this reach the unblock check
+            dbprintlf("No shields initialized on bus %d", bus);
+            return false;
         }
-        else if (data->steps && !(*(_this->done)) && !(_this->stop)) // integral step/not microstepping, no Ctrl+C received, emergency stop not pressed
+        // the stop and the fallback releases go ahead of every queued transfer
+        i2cbus_prio prio = bus_class;
+        bus_class = I2CBUS_PRIO_ESTOP;
+        // hold every shield so that no step frame lands between marking the moves to stop and the broadcast
+        for (auto sh : sb->shields)
+            sh->regs.lock();
+        for (auto sh : sb->shields)
+            for (int i = 0; i < 2; i++)
+                if (sh->steppers[i].initd)
+                {
+                    StepperMotor &mot = sh->steppers[i];
+                    mot.off_seq = mot.stop_seq = mot.queue.last();
+                }
+        bool status = false;
+        if (sb->allcall_open)
         {
-            _this->moving = true;
-            _this->onestep(data->dir, data->style);
-            data->steps--;
+            uint8_t buf[5] = {ALLLED_ON_L, 0, 0, 0, ALLLED_FULL}; // ALL_LED_OFF_H full off
+            int counter = 10;
+            i2cbus_msg msg = {0, 0, buf, sizeof(buf), 0};
+            while (!status && counter--)
+                status = busTransfer(sb->allcall, &msg, 1) == 1;
+            // a shield that missed the broadcast does not show up in the ACK, resend everything next time
+            for (auto sh : sb->shields)
+                sh->shadow_valid = 0;
         }
-        if (data->steps == 0 || (*(_this->done)) || _this->stop) // end reached/done = 1
+        if (!status)
         {
-            _this->moving = false;
-            _this->cond.notify_all();
+            dbprintlf("ALLCALL broadcast failed on bus %d, releasing motors one by one", bus);
+            status = true;
+            for (auto sh : sb->shields)
+            {
+                for (int i = 0; i < 4; i++)
+                    if (sh->dcmotors[i].initd)
+                        sh->dcmotors[i].fullOff();
+                for (int i = 0; i < 2; i++)
+                    if (sh->steppers[i].initd)
+                        sh->steppers[i].release();
+            }
         }
+        for (auto sh : sb->shields)
+            sh->regs.unlock();
+        bus_class = prio;
+        sb->stop_latency = get_timestamp() - start;
+        for (auto sh : sb->shields)
+            sh->engine.kick(); // drop the queued moves now
+
+        dbprintlf("Bus %d stopped in %" PRIu64 " ns", bus, sb->stop_latency);
+        return status;
     }
 
-    void StepperMotor::stepThreadFn(StepperMotor *mot, uint16_t steps, MotorDir dir, MotorStyle style)
+    void MotorShield::allFreeze(int bus)
     {
-        std::unique_lock<std::mutex> lock(mot->cs);
-        uint64_t uspers = mot->usperstep;
-
-        if (style == INTERLEAVE)
+        std::lock_guard<std::mutex> lock(shieldbus_lock);
+        ShieldBus *sb = findShieldBus(bus);
+        if (sb == nullptr)
+            return;
+        for (auto sh : sb->shields)
         {
-            uspers /= 2;
+            std::lock_guard<std::recursive_mutex> regs_lock(sh->regs);
+            for (int i = 0; i < 2; i++)
+                if (sh->steppers[i].initd)
+                    sh->steppers[i].stop_seq = sh->steppers[i].queue.last();
+            sh->engine.kick();
         }
-        else if (style == MICROSTEP)
-        {
-            uspers /= mot->microsteps;
-            steps *= mot->microsteps;
-        }
-        mot->stop = false;
-        StepperMotorTimerData data = {mot, steps, dir, style, mot->microsteps};
-        clkgen_t clk = create_clk(uspers * 1000LLU, stepHandlerFn, &data);
-        if (mot->cond.wait_for(lock, std::chrono::microseconds(steps * uspers)) == std::cv_status::timeout)
+    }
+
+    void MotorShield::armStart(int bus)
+    {
+        std::lock_guard<std::mutex> lock(shieldbus_lock);
+        ShieldBus *sb = findShieldBus(bus);
+        if (sb == nullptr)
+            return;
+        std::lock_guard<std::mutex> gate_lock(sb->gate_lock);
+        sb->armed = true;
+    }
+
+    void MotorShield::allStart(int bus)
+    {
+        std::lock_guard<std::mutex> lock(shieldbus_lock);
+        ShieldBus *sb = findShieldBus(bus);
+        if (sb == nullptr)
+            return;
         {
-            while (data.steps)
-            {
-                usleep(uspers);
-            }
+            std::lock_guard<std::mutex> gate_lock(sb->gate_lock);
+            sb->armed = false;
+            sb->start_at = get_timestamp(); // the held moves of every shield are planned from here
         }
-        destroy_clk(clk);
-        mot->moving = false;
+        for (auto sh : sb->shields)
+            sh->engine.kick();
     }
 
-    /*************** Steppers **************/
-    /***************************************/
-
-    /*************** MotorShield Private **************/
-    /**************************************************/
-#ifndef _DOXYGEN_
-#define LED0_ON_L 0x6
-#define LED0_ON_H 0x7
-#define LED0_OFF_L 0x8
-#define LED0_OFF_H 0x9
+    uint64_t MotorShield::getStopLatency(int bus)
+    {
+        std::lock_guard<std::mutex> lock(shieldbus_lock);
+        ShieldBus *sb = findShieldBus(bus);
+        return sb == nullptr ? 0 : sb->stop_latency;
+    }
 
-#define ALLLED_ON_L 0xFA
-#define ALLLED_ON_H 0xFB
-#define ALLLED_OFF_L 0xFC
-#define ALLLED_OFF_H 0xFD
+    bool MotorShield::setBusWorker(int bus, bool on, int priority)
+    {
+        if (on)
+            return i2cbus_worker_start(bus, priority) >= 0;
+        return i2cbus_worker_stop(bus) >= 0;
+    }
 
-#define PCA9685_SUBADR1 0x2
-#define PCA9685_SUBADR2 0x3
-#define PCA9685_SUBADR3 0x4
+    bool MotorShield::getBusWorker(int bus)
+    {
+        return i2cbus_worker_running(bus);
+    }
 
-#define PCA9685_MODE1 0x0
-#define PCA9685_PRESCALE 0xFE
-#endif // _DOXYGEN_
+    void MotorShield::setBusClass(i2cbus_prio prio)
+    {
+        bus_class = prio;
+    }
 
-    bool MotorShield::reset()
+    bool MotorShield::startArmed(uint64_t &t_start)
     {
-        return write8(PCA9685_MODE1, 0x0) > 0;
+        t_start = 0;
+        if (sbus == nullptr)
+            return false;
+        std::lock_guard<std::mutex> lock(sbus->gate_lock);
+        t_start = sbus->start_at;
+        return sbus->armed;
     }
 
-    bool MotorShield::setPWMFreq(float freq)
+    /************** MotorShield Broadcast *************/
+    /**************************************************/
+
+    /*************** MotorShield Private **************/
+    /**************************************************/
+
+    bool MotorShield::setPWMFreq(float freq, uint8_t mode1, uint8_t prescale_now)
     {
         dbprintlf("Attempting to set freq: %f", freq);
         freq *=
@@ -854,82 +1167,248 @@ namespace Adafruit
         uint8_t prescale = floor(prescaleval + 0.5);
         dbprintlf("Final pre-scale: %d", prescale);
 
-        uint8_t oldmode;
-        try
+        // auto increment for burst writes, ALLCALL for allOff()
+        uint8_t runmode = (mode1 & ~(PCA9685_RESTART | PCA9685_SLEEP)) | PCA9685_AI | PCA9685_ALLCALL;
+        bool status = true;
+        startup.prescale_skipped = prescale_now == prescale;
+        if (!startup.prescale_skipped)
         {
-            oldmode = read8(PCA9685_MODE1);
+            // PRESCALE can only be written while the oscillator is off
+            status &= write8(PCA9685_MODE1, (mode1 & ~PCA9685_RESTART) | PCA9685_SLEEP);
+            status &= write8(PCA9685_PRESCALE, prescale);
+            mode1 |= PCA9685_SLEEP;
         }
-        catch (const std::exception &e)
+        if (mode1 & PCA9685_SLEEP)
         {
-            dbprintlf("Error reading PCA9685_MODE1: %s", e.what());
-            return false;
+            status &= write8(PCA9685_MODE1, runmode);
+            usleep(500); // oscillator startup, 500 us max per datasheet
+            status &= write8(PCA9685_MODE1, runmode | PCA9685_RESTART);
+        }
+        else if ((mode1 & ~PCA9685_RESTART) != runmode)
+        {
+            status &= write8(PCA9685_MODE1, runmode);
         }
-        uint8_t newmode = (oldmode & 0x7F) | 0x10; // sleep
-        write8(PCA9685_MODE1, newmode);            // go to sleep
-        write8(PCA9685_PRESCALE, prescale);        // set the prescaler
-        write8(PCA9685_MODE1, oldmode);
-        usleep(5 * 1000);
-        write8(PCA9685_MODE1,
-               oldmode |
-                   0xa1); //  This sets the MODE1 register to turn on auto increment.
-                          // This is why the beginTransmission below was not working.
 #if (ADAFRUIT_MOTORSHIELD_DEBUG > 0)
+        uint8_t newmode;
         try
         {
             newmode = read8(PCA9685_MODE1);
+            dbprintlf("Mode now: 0x%02x", newmode);
         }
         catch (const std::exception &e)
         {
             dbprintlf("Error reading PCA9685_MODE1 after operation: %s", e.what());
         }
-        dbprintlf("Mode now: 0x%02x", newmode);
 #endif
-        return true;
+        return status;
+    }
+
+    bool MotorShield::clearAll()
+    {
+        std::lock_guard<std::recursive_mutex> lock(regs);
+        // LEDn_OFF_H full off bit on all channels, LEDn_ON left at 0
+        const uint8_t buf[4] = {0, 0, 0, ALLLED_FULL};
+        bool status = writeRegs(ALLLED_ON_L, buf, sizeof(buf));
+        // register contents after an ALL_LED write are not tracked, resend on first use
+        invalidateShadow();
+        return status;
     }
 
     bool MotorShield::setPWM(uint8_t num, uint16_t on,
                              uint16_t off)
     {
+        if (num > 15)
+        {
+            dbprintlf("Invalid channel %u", num);
+            return false;
+        }
+        std::lock_guard<std::recursive_mutex> lock(regs);
+        if (txn_depth)
+        {
+            txn_on[num] = on;
+            txn_off[num] = off;
+            txn_dirty |= 1 << num;
+            return true;
+        }
+        if ((shadow_valid & (1 << num)) && shadow_on[num] == on && shadow_off[num] == off)
+        {
+            writes_elided++;
+            return true;
+        }
         dbprintlf("Setting PWM %u: 0x%04x -> 0x%04x", num, on, off);
+        return writeChannels(num, 1, &on, &off);
+    }
 
-        // this is a single transaction
-        uint8_t buf[5] = {LED0_ON_L + 4 * num, on, on >> 8, off, off >> 8};
-        int counter = 10;
-        bool failed = true;
-        while (failed && counter--)
+    bool MotorShield::setPWMBurst(uint8_t first, uint8_t count, const uint16_t *on, const uint16_t *off)
+    {
+        if (!initd)
         {
-            failed = i2cbus_write(bus, buf, sizeof(buf)) != sizeof(buf);
+            bprintlf("MotorShield object not initialized, please invoke begin().");
+            return false;
         }
-        if (failed)
+        if (count == 0 || first + count > 16)
         {
-            dbprintlf("Failed to write to port 0x%02x", LED0_ON_L + 4 * num);
+            dbprintlf("Invalid channel range %u + %u", first, count);
             return false;
         }
-        return true;
+        // a commit of its own, or part of the open one: channels that already hold their value
+        // are dropped and the rest go out as one burst per run
+        beginTransaction();
+        for (uint8_t i = 0; i < count; i++)
+            setPWM(first + i, on[i], off[i]);
+        return commit();
+    }
+
+    bool MotorShield::flushTransaction()
+    {
+        ChannelRuns runs;
+        stageRuns(runs);
+        return runs.n == 0 || writeRuns(runs);
+    }
+
+    void MotorShield::stageRuns(ChannelRuns &runs)
+    {
+        uint16_t changed = 0;
+        for (uint8_t num = 0; num < 16; num++)
+        {
+            if (!(txn_dirty & (1 << num)))
+                continue;
+            if ((shadow_valid & (1 << num)) && shadow_on[num] == txn_on[num] && shadow_off[num] == txn_off[num])
+                writes_elided++;
+            else
+                changed |= 1 << num;
+        }
+        txn_dirty = 0;
+        // One burst per run of changed channels. Re-sending an unchanged channel to join two runs
+        // costs its 4 register bytes, a burst of its own only the address byte and the register
+        // pointer, so the runs are never bridged. The bursts go out as one combined transfer, so
+        // that every channel latches on the same STOP (MODE2 OCH = 0).
+        runs.n = 0;
+        uint8_t num = 0;
+        while (num < 16)
+        {
+            if (!(changed & (1 << num)))
+            {
+                num++;
+                continue;
+            }
+            runs.first[runs.n] = num;
+            for (; num < 16 && (changed & (1 << num)); num++)
+            {
+                runs.on[num] = txn_on[num];
+                runs.off[num] = txn_off[num];
+            }
+            runs.count[runs.n] = num - runs.first[runs.n];
+            dbprintlf("Committing PWM %u-%u in one burst", runs.first[runs.n], num - 1);
+            runs.n++;
+        }
+    }
+
+    bool MotorShield::writeChannels(uint8_t first, uint8_t count, const uint16_t *on, const uint16_t *off)
+    {
+        ChannelRuns runs;
+        runs.n = 1;
+        runs.first[0] = first;
+        runs.count[0] = count;
+        memcpy(runs.on + first, on, count * sizeof(uint16_t));
+        memcpy(runs.off + first, off, count * sizeof(uint16_t));
+        return writeRuns(runs);
+    }
+
+    uint8_t MotorShield::packRuns(const ChannelRuns &runs, uint8_t *buf, i2cbus_msg *msgs) const
+    {
+        // MODE1 auto-increment (set in setPWMFreq) walks LEDn_ON_L .. LEDn_OFF_H across channels;
+        // one message per run, separated by repeated starts
+        uint8_t *p = buf;
+        for (uint8_t r = 0; r < runs.n; r++)
+        {
+            msgs[r] = {_addr, 0, p, 1 + 4 * runs.count[r], 0};
+            *p++ = LED0_ON_L + 4 * runs.first[r];
+            for (uint8_t num = runs.first[r]; num < runs.first[r] + runs.count[r]; num++)
+            {
+                *p++ = runs.on[num];
+                *p++ = runs.on[num] >> 8;
+                *p++ = runs.off[num];
+                *p++ = runs.off[num] >> 8;
+            }
+        }
+        return runs.n;
+    }
+
+    void MotorShield::runsWritten(const ChannelRuns &runs, bool ok)
+    {
+        if (!ok)
+        {
+            dbprintlf("Failed to write %u channel runs from port 0x%02x", runs.n, LED0_ON_L + 4 * runs.first[0]);
+            shadow_valid = 0; // chip state unknown after a bus error
+            return;
+        }
+        for (uint8_t r = 0; r < runs.n; r++)
+        {
+            for (uint8_t num = runs.first[r]; num < runs.first[r] + runs.count[r]; num++)
+            {
+                shadow_on[num] = runs.on[num];
+                shadow_off[num] = runs.off[num];
+                shadow_valid |= 1 << num;
+            }
+            writes_issued += runs.count[r];
+        }
+    }
+
+    bool MotorShield::writeRuns(const ChannelRuns &runs)
+    {
+        uint8_t buf[8 + 4 * 16];
+        i2cbus_msg msgs[8];
+        uint8_t n = packRuns(runs, buf, msgs);
+        int counter = 10;
+        bool failed = true;
+        while (failed && counter--)
+        {
+            failed = busTransfer(bus, msgs, n) != n;
+        }
+        runsWritten(runs, !failed);
+        return !failed;
     }
 
     uint8_t _Catchable MotorShield::read8(uint8_t addr)
     {
         uint8_t data = 0x0;
+        if (!readRegs(addr, &data, 1))
+            throw std::runtime_error("Could not execute read/write transaction on I2C bus");
+        return data;
+    }
+
+    bool MotorShield::readRegs(uint8_t addr, uint8_t *data, uint8_t len)
+    {
+        // register pointer write and read in one transfer (repeated start), auto-increment walks the registers
+        i2cbus_msg msgs[2] = {{0, 0, &addr, 1, 0}, {0, 1, data, len, 0}};
         int counter = 10;
         bool failed = true;
         while (failed && counter--)
         {
-            failed = i2cbus_xfer(bus, &addr, 1, &data, 1, 20) != 1;
+            failed = busTransfer(bus, msgs, 2) != 2;
         }
         if (failed)
-            throw std::runtime_error("Could not execute read/write transaction on I2C bus");
-        return data;
+            dbprintlf("Failed to read %u registers from 0x%02x", len, addr);
+        return !failed;
     }
 
     bool MotorShield::write8(uint8_t addr, uint8_t d)
+    {
+        return writeRegs(addr, &d, 1);
+    }
+
+    bool MotorShield::writeRegs(uint8_t addr, const uint8_t *data, uint8_t len)
     {
         int counter = 10;
         bool failed = true;
-        uint8_t buf[2] = {addr, d};
+        uint8_t buf[256];
+        buf[0] = addr;
+        memcpy(buf + 1, data, len);
+        i2cbus_msg msg = {0, 0, buf, len + 1, 0};
         while (failed && counter--)
         {
-            failed = i2cbus_write(bus, buf, 2) != 2;
+            failed = busTransfer(bus, &msg, 1) != 1;
         }
         if (failed)
             return false;
@@ -34,10 +34,13 @@
 #include <stdint.h>
 #include <signal.h>
 #include "i2cbus/i2cbus.h"
-#include "clkgen.h"
+#include "StepTables.hpp"
+#include "MotionEngine.hpp"
 
 #include <mutex>
 #include <condition_variable>
+#include <atomic>
+#include <vector>
 
 namespace Adafruit
 {
@@ -62,60 +65,10 @@ namespace Adafruit
  */
 #define _Catchable
 
-    /**
-     * @brief Defines the stepping technique used to actuate stepper motors.
-     *
-     * @var SINGLE
-     * Single coil stepping
-     * @var DOUBLE
-     * Double coil stepping
-     * @var INTERLEAVE
-     * Double coil interleaved stepping
-     * @var MICROSTEP
-     * Microstepping, achieves a smoother motion by dividing a step into smaller 'micro'steps.
-     */
-    typedef enum : uint8_t
-    {
-        SINGLE = 1,
-        DOUBLE = 2,
-        INTERLEAVE = 3,
-        MICROSTEP = 4
-    } MotorStyle;
-
-    /**
-     * @brief Defines the direction of motor actuation.
-     *
-     */
-    typedef enum : uint8_t
-    {
-        FORWARD = 1,  /*!< Forward direction */
-        BACKWARD = 2, /*!< Backward direction */
-        BRAKE = 3,    /*!< Not used */
-        RELEASE = 4   /*!< Release the motor. */
-        /*!< In case of DC motor, stops running. */
-        /*!< In case of stepper motor, removes stall torque and powers down the coils. */
-    } MotorDir;
-
-    /**
-     * Defines the number of microsteps executed per step
-     * of a stepper motor. Increasing microsteps per step limits
-     * the maximum RPM achievable by a stepper motor due to I2C bus
-     * constraints. Upper limits for each microstep for a 200 steps/revolution,
-     * double coil stepper motor are provided.
-     *
-     */
-    typedef enum : uint16_t
-    {
-        STEP8 = 8,     /*!< 8 microsteps per step, max speed 10 RPM. */
-        STEP16 = 16,   /*!< 16 microsteps per step, max speed 5 RPM. */
-        STEP32 = 32,   /*!< 32 microsteps per step, max speed 2.5 RPM. */
-        STEP64 = 64,   /*!< 64 microsteps per step, max speed 1.25 RPM. */
-        STEP128 = 128, /*!< 128 microsteps per step, max speed 0.625 RPM. */
-        STEP256 = 256, /*!< 256 microsteps per step, max speed 0.3125 RPM. */
-        STEP512 = 512  /*!< 512 microsteps per step, max speed 0.15625 RPM. */
-    } MicroSteps;
-
     class MotorShield;
+#ifndef _DOXYGEN_
+    struct ShieldBus;
+#endif
 
     /**
      * @brief Object that controls and keeps state for a single DC motor.
@@ -172,23 +125,18 @@ namespace Adafruit
         bool initd;
     };
 
-#ifndef _DOXYGEN_
-    class StepperMotor;
-    struct StepperMotorTimerData
-    {
-        StepperMotor *_this;
-        uint16_t steps;
-        MotorDir dir;
-        MotorStyle style;
-        MicroSteps msteps;
-    };
-
-    struct StepperMotorDestroyClkData
+    /**
+     * @brief Stepping rate of a stepper motor, as measured by the motion engine.
+     *
+     */
+    struct StepperRate
     {
-        StepperMotor *_this;
-        clkgen_t clk;
+        MotorStyle style;     ///< Style of the running or last move
+        double commanded_rpm; ///< Speed set using {@link Adafruit::StepperMotor::setSpeed}
+        double achieved_rpm;  ///< Mean speed of the running or last move between its first and latest step, 0 before its second step
+        double max_rpm;       ///< Highest speed the bus sustains in that style, 0 until the style has been stepped by the engine
+        double io_us;         ///< Mean bus time of one step tick in that style, 0 until measured
     };
-#endif
 
     /**
      * @brief Object that controls and keeps state for a single stepper motor.
@@ -197,8 +145,11 @@ namespace Adafruit
     class StepperMotor
     {
     private:
-        static void stepHandlerFn(clkgen_t clk, void *data_);
-        static void stepThreadFn(StepperMotor *mot, uint16_t steps, MotorDir dir, MotorStyle style);
+        void loadPhaseFns();
+        StepPhase advance(MotorDir dir, MotorStyle style);
+        void tickDone(uint64_t tstamp, uint64_t io_ns, MotorStyle style, bool first);
+        double ticksPerStep(MotorStyle style) const;
+        double maxRPM(MotorStyle style) const;
 
     protected:
         /**
@@ -210,24 +161,134 @@ namespace Adafruit
     public:
         /**
          * @brief Set the delay for the Stepper Motor speed in RPM.
-         * Throws exception in case rpm <= 0.
+         * Throws exception in case rpm <= 0. Can be called while the motor is moving: the running
+         * and queued moves change to the new speed from the next step, at the acceleration set
+         * using {@link Adafruit::StepperMotor::setProfile} (at once with the CONSTANT profile).
+         * The microstepped final approach of HYBRID moves keeps its speed.
          *
          * @param rpm The desired RPM, it is not guaranteed to be achieved. In double coil mode upto ~68 RPM is achieved for a 200 steps/rev stepper, in microstep mode ~1.25 RPM is achieved for a 200 steps/rev stepper at STEP64 setting, ~0.3125 RPM at STEP256 setting.
          *
-         * @return bool true on success, false on failure.
+         * @return bool true on success.
          */
         bool _Catchable setSpeed(double rpm);
 
+        /**
+         * @brief Set the velocity profile of moves made with {@link Adafruit::StepperMotor::step}.
+         * With TRAPEZOID or SCURVE, moves start at start_rpm, accelerate up to the speed set using
+         * {@link Adafruit::StepperMotor::setSpeed}, and decelerate back to start_rpm at the end.
+         * Moves too short to reach the set speed turn around at a lower peak speed.
+         * Throws exception on invalid parameters.
+         *
+         * @param profile CONSTANT (default, no ramps), TRAPEZOID or SCURVE.
+         * @param accel Acceleration and deceleration in RPM per second, required for TRAPEZOID and SCURVE.
+         * @param jerk Rate of change of acceleration in RPM per second squared, required for SCURVE.
+         * @param start_rpm Speed at which moves start and end, 0 to start from rest.
+         * @return bool true on success, false if moves are outstanding.
+         */
+        bool _Catchable setProfile(MotionProfile profile, double accel = 0, double jerk = 0, double start_rpm = 0);
+
+        /**
+         * @brief Set up HYBRID style moves: the travel is made in double coil steps, at the speed and
+         * profile of DOUBLE moves, and the last fine_steps steps are microstepped at fine_rpm. Before the
+         * first double coil step the motor is microstepped to the nearest double coil position, so the
+         * move ends on the same microstep as a MICROSTEP move of the same length.
+         * Throws exception if fine_rpm is negative.
+         *
+         * @param fine_steps Steps at the end of the move to microstep, 1 by default.
+         * @param fine_rpm Speed of the microstepped parts in RPM, 0 (default) for the speed set using {@link Adafruit::StepperMotor::setSpeed}.
+         * @return bool true on success, false if moves are outstanding.
+         */
+        bool _Catchable setHybrid(uint16_t fine_steps, double fine_rpm = 0);
+
+        /**
+         * @brief Set what the motion engine does when it falls behind the schedule of a move,
+         * i.e. makes a step tick after the deadline of the tick following it. With LATE_CATCHUP
+         * (default) the move keeps its planned duration, the ticks it is behind are made at up
+         * to catchup times the planned rate, or back to back without a limit (default); with
+         * LATE_STRETCH the rest of the move keeps its step intervals and ends later by the time
+         * lost. Throws exception if catchup is below 1.
+         *
+         * @param policy LATE_CATCHUP or LATE_STRETCH.
+         * @param catchup Highest rate of late ticks as a multiple of the planned rate, 0 (default) for no limit.
+         * @return bool true on success, false if moves are outstanding.
+         */
+        bool _Catchable setLatePolicy(LatePolicy policy, double catchup = 0);
+
+        /**
+         * @brief Get the number of step ticks the motion engine made after the deadline of the
+         * tick following them, since the motor was created.
+         *
+         * @return uint64_t Missed ticks.
+         */
+        uint64_t getMissedTicks() const;
+
+        /**
+         * @brief Record the time of every step tick made by the motion engine, for checking
+         * the achieved velocity profile. The last len ticks are kept.
+         *
+         * @param len Number of ticks to keep, 0 to stop recording.
+         */
+        void setTrace(size_t len);
+
+        /**
+         * @brief Copy the recorded step tick times, oldest first, and clear the record.
+         *
+         * @param tstamps CLOCK_MONOTONIC times (ns) at which the step frames were sent.
+         * @param max Size of tstamps.
+         * @return size_t Number of times copied.
+         */
+        size_t getTrace(uint64_t *tstamps, size_t max);
+
         /**
          * @brief Move the stepper motor with the given RPM speed,
          * at the speed set using {@link Adafruit::StepperMotor::setSpeed}. Throws exception if RPM was not set prior to call.
+         * The move is queued on the shield's {@link Adafruit::MotionEngine}; moves of a motor run back to back
+         * in the order they were requested.
          *
-         * @param steps Number of steps to move.
+         * @param steps Number of steps to move, full steps in every style.
          * @param dir The direction of movement, can be FORWARD or BACKWARD.
-         * @param style Stepping style, can be SINGLE, DOUBLE, INTERLEAVE or MICROSTEP. SINGLE by default.
+         * @param style Stepping style, can be SINGLE, DOUBLE, INTERLEAVE, MICROSTEP or HYBRID (see {@link Adafruit::StepperMotor::setHybrid}). SINGLE by default.
          * @param blocking Whether the step function blocks until stepping is complete. Set to true by default.
+         * A non-blocking call returns as soon as the move is queued.
+         */
+        void _Catchable step(uint64_t steps, MotorDir dir, MotorStyle style = SINGLE, bool blocking = true);
+
+        /**
+         * @brief Queue a move without waiting for it, at the speed and profile set when it is queued.
+         * Moves of a motor run back to back in the order they were queued; up to
+         * STEPPER_QUEUE_LEN moves can be outstanding. With TRAPEZOID or SCURVE profiles,
+         * consecutive queued moves in the same direction and style are blended: the motor
+         * keeps its speed from one to the next and only slows down where the direction
+         * or style changes, at a {@link Adafruit::StepperMotor::dwell} or at the last queued move. Safe to call from any thread,
+         * including from a {@link Adafruit::MoveCallback}. Throws exception if RPM was not set prior to call.
+         *
+         * @param steps Number of steps to move, full steps in every style.
+         * @param dir The direction of movement, can be FORWARD or BACKWARD.
+         * @param style Stepping style, can be SINGLE, DOUBLE, INTERLEAVE, MICROSTEP or HYBRID. SINGLE by default.
+         * @param cb Function called from the motion engine when the move is done or aborted, optional.
+         * @param user Argument passed to cb.
+         * @return MoveHandle Handle to wait on or poll, invalid if the queue is full or steps is 0.
+         */
+        MoveHandle _Catchable move(uint64_t steps, MotorDir dir, MotorStyle style = SINGLE, MoveCallback cb = nullptr, void *user = nullptr);
+
+        /**
+         * @brief Queue a pause: the motor holds still for a time after the moves queued
+         * before it, and moves on either side of a dwell are not blended.
+         * Throws exception if ms is negative.
+         *
+         * @param ms Time to hold still, in milliseconds.
+         * @param cb Function called from the motion engine when the dwell is over, optional.
+         * @param user Argument passed to cb.
+         * @return MoveHandle Handle to wait on or poll, invalid if the queue is full.
          */
-        void _Catchable step(uint16_t steps, MotorDir dir, MotorStyle style = SINGLE, bool blocking = true);
+        MoveHandle _Catchable dwell(double ms, MoveCallback cb = nullptr, void *user = nullptr);
+
+        /**
+         * @brief Get the number of queued and running moves.
+         *
+         * @return size_t Outstanding moves, 0 when the motor is idle.
+         */
+        size_t queuedMoves() const;
 
         /**
          * @brief Move the stepper motor by one step. No delays implemented.
@@ -238,18 +299,19 @@ namespace Adafruit
          *
          * @param dir The direction of movement, can be FORWARD or BACKWARD.
          * @param style Stepping style, can be SINGLE, DOUBLE, INTERLEAVE or MICROSTEP.
-         * @return uint8_t The current step/microstep index, useful for
+         * @return uint16_t The current step/microstep index, useful for
          * Adafruit_StepperMotor.step to keep track of the current
-         * location, especially when microstepping.
+         * location, especially when microstepping. It goes up to
+         * 4 * microsteps - 1, past 255 from STEP128 on.
          */
-        uint8_t onestep(MotorDir dir, MotorStyle style);
+        uint16_t onestep(MotorDir dir, MotorStyle style);
 
         /**
          * @brief Set microsteps per step.
          *
          * @param microsteps {@link Adafruit::MicroSteps} members.
          *
-         * @return bool true on success, false on failure.
+         * @return bool true on success, false if moves are outstanding.
          */
         bool setStep(MicroSteps microsteps);
 
@@ -259,6 +321,31 @@ namespace Adafruit
          */
         void release(void);
 
+        /**
+         * @brief Get the absolute position of the motor, counted from the last
+         * {@link Adafruit::StepperMotor::setPosition} call (0 at startup) in every style,
+         * including {@link Adafruit::StepperMotor::onestep}.
+         *
+         * @return int64_t Position in microsteps of the current microstep setting, rounded down.
+         */
+        int64_t getPosition() const;
+
+        /**
+         * @brief Get the absolute position of the motor in steps, with the fraction of a step
+         * made by microstepping.
+         *
+         * @return double Position in full steps.
+         */
+        double getPositionSteps() const;
+
+        /**
+         * @brief Set the absolute position of the motor, e.g. 0 at a home switch.
+         *
+         * @param microsteps Position in microsteps of the current microstep setting.
+         * @return bool true on success, false if moves are outstanding.
+         */
+        bool setPosition(int64_t microsteps);
+
         /**
          * @brief Check if the motor is stepping.
          *
@@ -267,7 +354,8 @@ namespace Adafruit
         bool isMoving() const;
 
         /**
-         * @brief Stop stepping the motor.
+         * @brief Stop stepping the motor. The running move and the moves queued before
+         * the call are aborted, moves queued after it run normally.
          *
          */
         void stopMotor();
@@ -275,30 +363,87 @@ namespace Adafruit
         /**
          * @brief Get the time period of each full step.
          * The time period is useful in case of onestepping/manual stepping. Throws exception if RPM was not set prior to call.
+         * If the bus can not step as fast as the set speed in the style of the last move, the
+         * measured shortest period is returned instead, see {@link Adafruit::StepperMotor::getRate}.
          *
-         * @return uint64_t Time period of a full step
+         * @return uint64_t Time period of a full step in microseconds
          */
         uint64_t _Catchable getStepPeriod() const;
 
-        friend class MotorShield; ///< Let MotorShield create StepperMotors
+        /**
+         * @brief Get the set, achieved and highest sustainable speed of the motor. The motion engine
+         * measures the bus time of every step tick; when it exceeds the step interval the engine
+         * steps back to back and the motor runs at the highest sustainable speed instead of the set one.
+         *
+         * @return StepperRate Rates of the running or last move.
+         */
+        StepperRate getRate() const;
+
+        /**
+         * @brief Get the highest speed the bus sustains for moves in a style, at the current microstep setting.
+         * When both ports of a shield step together, each port is charged the time of the shared frame.
+         *
+         * @param style Stepping style, HYBRID reports the double coil part.
+         * @return double Speed in RPM, 0 until the style has been stepped by the motion engine.
+         */
+        double getMaxRPM(MotorStyle style) const;
+
+        friend class MotorShield;  ///< Let MotorShield create StepperMotors
+        friend class MotionEngine; ///< Let the shield's engine run moves
+        friend class MoveHandle;   ///< Let handles wait on move completion
 
     protected:
         uint64_t usperstep;
         MicroSteps microsteps;
 
     private:
-        std::mutex cs;
+        mutable std::mutex cs;
         std::condition_variable cond;
-        uint16_t *microstepcurve;
+        StepPhaseFn phasefn[MICROSTEP]; // phase sequencer per style at the current microstep setting
         uint8_t PWMApin, AIN1pin, AIN2pin;
         uint8_t PWMBpin, BIN1pin, BIN2pin;
+        uint8_t FRAMEpin; // lowest of the six contiguous channels of this port
         uint16_t revsteps; // # steps per revolution
-        uint16_t currentstep;
+        uint16_t currentstep; // phase within the electrical cycle, in microsteps
+        std::atomic<int64_t> position; // absolute position in 1/MICROSTEP_MAX steps
         MotorShield *MC;
         bool initd;
         volatile sig_atomic_t *done;
-        volatile bool moving;
-        volatile bool stop;
+        std::atomic<uint64_t> stop_seq; // moves up to this sequence number are to be stopped
+        std::atomic<uint64_t> off_seq;  // moves up to this sequence number were cut off by allOff, no alignment steps
+        std::atomic<uint64_t> speed_req; // speed (us per step) for the engine to apply to outstanding moves, 0 if none
+        MoveQueue queue; // moves for the shield's engine
+        MotionProfile profile;
+        double accel_rpms;  // RPM/s
+        double jerk_rpms2;  // RPM/s^2
+        double start_rpm;
+        uint16_t hybrid_steps; // steps microstepped at the end of a HYBRID move
+        double hybrid_rpm;     // their speed, 0 for the set speed
+        LatePolicy late_policy; // handling of ticks made behind schedule
+        double catchup;         // rate limit of late ticks, multiple of the planned rate, 0 for none
+        std::atomic<uint64_t> missed_ticks; // ticks made after the deadline of the next tick
+        std::vector<uint64_t> trace; // step tick times, guarded by cs
+        size_t trace_head;
+        size_t trace_count;
+        double io_ns[MICROSTEP];     // mean bus time of a step tick per style, guarded by cs
+        uint64_t io_ticks[MICROSTEP]; // ticks measured per style
+        MotorStyle rate_style;       // style of the last move
+        uint64_t rate_first, rate_last; // times of the first and latest tick of the last move
+        double rate_steps;           // full steps between them
+    };
+
+    /**
+     * @brief Time spent in each phase of {@link Adafruit::MotorShield::begin}, in nanoseconds.
+     *
+     */
+    struct ShieldStartupTiming
+    {
+        uint64_t open;     ///< Opening the I2C device
+        uint64_t mode;     ///< Reading MODE1/PRESCALE and configuring MODE2
+        uint64_t prescale; ///< Setting the prescaler and waking the oscillator
+        uint64_t clear;    ///< Turning all channels off
+        uint64_t total;    ///< Whole begin() call
+        bool prescale_skipped; ///< The prescaler already held the requested value, no sleep cycle was needed
     };
 
     /**
@@ -314,8 +459,9 @@ namespace Adafruit
          *
          * @param addr Optional, default: 0x60
          * @param bus Optional, default: 1
+         * @param shared_fd Optional, default: false. Open the shield on the descriptor of the bus shared with the other shields opened this way ({@link i2cbus_open_shared}) instead of a descriptor of its own.
          */
-        MotorShield(uint8_t addr = 0x60, int bus = 1);
+        MotorShield(uint8_t addr = 0x60, int bus = 1, bool shared_fd = false);
 
         /**
          * @brief Release all motors and the I2C Bus.
@@ -325,6 +471,10 @@ namespace Adafruit
 
         /**
          * @brief Initialize the I2C hardware and PWM driver, then turn off all pins.
+         * The prescaler is only reprogrammed (which needs the oscillator to be put to
+         * sleep and woken up again) if it does not already hold the value for freq,
+         * and all pins are turned off with one write to the ALL_LED_OFF registers.
+         * Shields on the same bus can be brought up concurrently from separate threads.
          *
          * @param freq The PWM frequency for the driver, used for speed control and microstepping.
          * By default 1600 Hz is used, which is a little audible but efficient.
@@ -371,19 +521,246 @@ namespace Adafruit
          */
         bool setPin(uint8_t pin, bool val);
 
+        /**
+         * @brief Move both stepper ports by one step in the same step tick. The changed
+         * channels of port 1 (LED8-LED13) and port 2 (LED2-LED7) are sent as bursts of
+         * one combined I2C transfer, so both motors switch on the same STOP condition
+         * with one kernel call, for about the bus bytes of two single steps.
+         * A port whose direction is BRAKE or RELEASE holds its current outputs.
+         * Do not step the same motor from another thread while using this function.
+         *
+         * @param dir1 Direction of the port 1 stepper, FORWARD or BACKWARD to move, BRAKE or RELEASE to hold.
+         * @param dir2 Direction of the port 2 stepper, FORWARD or BACKWARD to move, BRAKE or RELEASE to hold.
+         * @param style Stepping style, can be SINGLE, DOUBLE, INTERLEAVE or MICROSTEP.
+         * @return bool true on success, false on failure.
+         */
+        bool onestepBoth(MotorDir dir1, MotorDir dir2, MotorStyle style);
+
+        /**
+         * @brief De-energize every motor on every shield of an I2C bus with a single
+         * write of the ALL_LED_OFF registers to the PCA9685 ALLCALL address (0x70).
+         * Timed moves on all shields of the bus are stopped before the broadcast, so no
+         * step frame can re-energize a coil after it, a MICROSTEP move is cut off between
+         * full steps instead of stepping on to the next one. Motors stepped manually with
+         * {@link Adafruit::StepperMotor::onestep} must be stopped by the caller.
+         * Falls back to releasing every motor individually if the ALLCALL address
+         * can not be opened.
+         *
+         * @param bus I2C bus index (X in /dev/i2c-X).
+         * @return bool true on success, false on failure.
+         */
+        static bool allOff(int bus = 1);
+
+        /**
+         * @brief Stop timed moves on every shield of an I2C bus at the current step,
+         * keeping the coils energized. No bus traffic is generated.
+         *
+         * @param bus I2C bus index (X in /dev/i2c-X).
+         */
+        static void allFreeze(int bus = 1);
+
+        /**
+         * @brief Hold the start of timed moves on every shield of an I2C bus until
+         * {@link Adafruit::MotorShield::allStart} is called. Moves requested in the
+         * mean time wait before their first step.
+         *
+         * @param bus I2C bus index (X in /dev/i2c-X).
+         */
+        static void armStart(int bus = 1);
+
+        /**
+         * @brief Release all moves held by {@link Adafruit::MotorShield::armStart}
+         * at once. The held moves of every shield are planned from the time of this
+         * call, so they run on one timeline; the start is loosely synchronized, each
+         * shield's engine sends its own first frame as soon as it wakes up, and the
+         * shields do not switch in one transfer.
+         *
+         * @param bus I2C bus index (X in /dev/i2c-X).
+         */
+        static void allStart(int bus = 1);
+
+        /**
+         * @brief Get the time taken by the last {@link Adafruit::MotorShield::allOff}
+         * call on a bus, from the call to the completion of the broadcast.
+         *
+         * @param bus I2C bus index (X in /dev/i2c-X).
+         * @return uint64_t Stop latency in nanoseconds, 0 if no stop was issued.
+         */
+        static uint64_t getStopLatency(int bus = 1);
+
+        /**
+         * @brief Run the bus I/O of the shields on a bus on a worker thread of the bus
+         * ({@link i2cbus_worker_start}). Step frames, stops and all other transfers are
+         * then queued to the worker without taking the bus lock, and the worker runs
+         * them by urgency: allOff first, then step frames, then everything else. Off by
+         * default, the transfers then run in the calling thread.
+         *
+         * @param bus I2C bus index (X in /dev/i2c-X).
+         * @param on true to start the worker, false to stop it.
+         * @param priority SCHED_FIFO priority of the worker (1-99), 0 for the default scheduler. Use at least the priority of the stepping threads set with {@link Adafruit::MotorShield::setRealtime}.
+         * @return bool true if the worker is in the requested state.
+         */
+        static bool setBusWorker(int bus, bool on, int priority = 0);
+
+        /**
+         * @brief Check whether the shields on a bus run their I/O on a worker thread.
+         *
+         * @param bus I2C bus index (X in /dev/i2c-X).
+         * @return bool true if the bus has a worker.
+         */
+        static bool getBusWorker(int bus = 1);
+
+        /**
+         * @brief Start collecting channel changes instead of writing them. setPWM, setPin
+         * and step frames issued by this thread are staged until the matching {@link Adafruit::MotorShield::commit},
+         * other threads writing to this shield wait until then. Transactions nest, the
+         * outermost commit writes.
+         *
+         */
+        void beginTransaction();
+
+        /**
+         * @brief Write the changes staged since {@link Adafruit::MotorShield::beginTransaction}.
+         * Channels that already hold their value are dropped and the rest go out as
+         * one auto-increment burst per run of channels, all in one combined I2C transfer. The
+         * PCA9685 is set to update its outputs on the STOP condition, so all committed
+         * channels switch at the same time.
+         *
+         * @return bool true on success, false on failure.
+         */
+        bool commit();
+
+        /**
+         * @brief Commit the transactions of several shields on one bus in a single
+         * combined I2C transfer, so that the channels of all the shields switch on the
+         * same STOP condition, in one kernel call. Each shield must have a transaction
+         * begun by this thread with {@link Adafruit::MotorShield::beginTransaction};
+         * shields on other buses than the first one are committed on their own.
+         * A transfer carries up to I2CBUS_BATCH_MAX (42) bursts and a shield sends one
+         * per run of changed channels, up to 8. A group with more bursts is split
+         * between shields into several transfers: every shield switches all of its
+         * channels at once, but only the shields of one transfer switch together.
+         *
+         * @param shields Shields whose transactions end.
+         * @return bool true if every shield's changes were written.
+         */
+        static bool commitGroup(const std::vector<MotorShield *> &shields);
+
+        /**
+         * @brief Read back the LEDn_ON/LEDn_OFF registers of all 16 channels in one
+         * 64-byte transfer, for startup verification and diagnostics.
+         *
+         * @param on LEDn_ON values read from the chip.
+         * @param off LEDn_OFF values read from the chip.
+         * @return bool true on success, false on failure.
+         */
+        bool readChannels(uint16_t on[16], uint16_t off[16]);
+
+        /**
+         * @brief Forget the cached LEDn_ON/OFF register contents, so that the next
+         * write to every channel goes out on the bus. The cache is invalidated
+         * automatically on begin() and on I2C errors; call this if the PCA9685
+         * may have been written to by something other than this object.
+         *
+         */
+        void invalidateShadow();
+
+        /**
+         * @brief Get the number of channel writes that were sent on the bus.
+         *
+         * @return uint64_t Channel writes issued.
+         */
+        uint64_t getWritesIssued() const;
+
+        /**
+         * @brief Get the number of channel writes that were skipped because the
+         * channel already held the requested value.
+         *
+         * @return uint64_t Channel writes elided.
+         */
+        uint64_t getWritesElided() const;
+
+        /**
+         * @brief Get the time spent in each phase of the last {@link Adafruit::MotorShield::begin} call.
+         *
+         * @return ShieldStartupTiming Per-phase startup timing.
+         */
+        ShieldStartupTiming getStartupTiming() const;
+
+        /**
+         * @brief Run the stepping thread of the shield in real time: SCHED_FIFO at the
+         * given priority, optionally pinned to one CPU, with the process memory locked
+         * and the thread's stack prefaulted, so that step ticks are not delayed by other
+         * threads or page faults. The stepping path does not allocate memory once a move
+         * is queued. Off by default; needs CAP_SYS_NICE (or an RLIMIT_RTPRIO) and
+         * CAP_IPC_LOCK (or a large enough RLIMIT_MEMLOCK), settings that are refused
+         * leave the thread as it was.
+         *
+         * @param cfg Real-time settings, priority 0, cpu -1 and no memory lock for normal scheduling.
+         * @return bool true if every setting was applied, false otherwise.
+         */
+        bool setRealtime(const RealtimeConfig &cfg);
+
+        /**
+         * @brief Get the real-time settings last requested with {@link Adafruit::MotorShield::setRealtime}.
+         *
+         * @return RealtimeConfig Real-time settings.
+         */
+        RealtimeConfig getRealtime() const;
+
+        friend class StepperMotor; ///< Let StepperMotor send step frames
+        friend class MotionEngine; ///< Let the engine step both ports in one frame
+
     private:
+        /**
+         * @brief Channel runs of a commit, each written in one auto-increment burst.
+         *
+         */
+        struct ChannelRuns
+        {
+            uint8_t n;         // number of runs
+            uint8_t first[8];  // first channel of each run
+            uint8_t count[8];  // channels in each run
+            uint16_t on[16];   // LEDn_ON values, by channel
+            uint16_t off[16];  // LEDn_OFF values, by channel
+        };
         bool initd;
         uint8_t _addr;
         int _bus;
+        bool _shared;              // opened on the shared descriptor of the bus
         uint16_t _freq;
         DCMotor dcmotors[4];
         StepperMotor steppers[2];
         i2cbus bus[1];
-        bool reset();
-        bool setPWMFreq(float freq);
+        ShieldBus *sbus;           // shields on the same I2C bus
+        mutable std::recursive_mutex regs; // guards the shadow registers and write counters
+        uint16_t shadow_on[16];    // last LEDn_ON value written to the chip
+        uint16_t shadow_off[16];   // last LEDn_OFF value written to the chip
+        uint16_t shadow_valid;     // bit n set if channel n of the shadow matches the chip
+        uint64_t writes_issued;    // channel writes sent on the bus
+        uint64_t writes_elided;    // channel writes skipped by the shadow
+        int txn_depth;             // nesting level of beginTransaction()
+        uint16_t txn_dirty;        // bit n set if channel n is staged
+        uint16_t txn_on[16];       // staged LEDn_ON values
+        uint16_t txn_off[16];      // staged LEDn_OFF values
+        ShieldStartupTiming startup; // timing of the last begin()
+        MotionEngine engine;         // stepping thread of both ports
+        bool setPWMFreq(float freq, uint8_t mode1, uint8_t prescale_now);
+        bool clearAll();
         bool setPWM(uint8_t num, uint16_t on, uint16_t off);
+        bool setPWMBurst(uint8_t first, uint8_t count, const uint16_t *on, const uint16_t *off);
+        bool flushTransaction();
+        bool writeChannels(uint8_t first, uint8_t count, const uint16_t *on, const uint16_t *off);
+        void stageRuns(ChannelRuns &runs);
+        uint8_t packRuns(const ChannelRuns &runs, uint8_t *buf, i2cbus_msg *msgs) const;
+        void runsWritten(const ChannelRuns &runs, bool ok);
+        bool writeRuns(const ChannelRuns &runs);
+        bool startArmed(uint64_t &t_start);
+        static void setBusClass(i2cbus_prio prio);
         uint8_t _Catchable read8(uint8_t addr);
+        bool readRegs(uint8_t addr, uint8_t *data, uint8_t len);
         bool write8(uint8_t addr, uint8_t d);
+        bool writeRegs(uint8_t addr, const uint8_t *data, uint8_t len);
     };
 };
 
@@ -0,0 +1,267 @@
+/**
+ * @file MoveQueue.hpp
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Bounded lock-free queue of stepper moves and the completion handles
+ * returned to the callers that queue them. Any thread may queue moves on a
+ * motor; the shield's motion engine is the only consumer.
+ * @version 2.0.0
+ * @date 2022-04-09
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef _MoveQueue_hpp_
+#define _MoveQueue_hpp_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "StepTables.hpp"
+
+#include <atomic>
+
+namespace Adafruit
+{
+/**
+ * @brief Number of moves that can be outstanding (queued or running) on a stepper motor.
+ * Has to be a power of 2.
+ *
+ */
+#define STEPPER_QUEUE_LEN 32
+
+    class StepperMotor;
+
+    /**
+     * @brief A move of one stepper port, as executed by the {@link Adafruit::MotionEngine}.
+     *
+     */
+    struct StepperMove
+    {
+        MotorDir dir;     ///< FORWARD or BACKWARD
+        MotorStyle style; ///< Stepping style
+        uint16_t msteps;  ///< Microsteps per step the move was planned with
+        uint64_t steps;   ///< Step ticks to run (microsteps in MICROSTEP and HYBRID style)
+        double v_start;   ///< Velocity at the start, ticks/s
+        double v_cruise;  ///< Maximum velocity, ticks/s
+        double v_end;     ///< Velocity at the end, ticks/s
+        double accel;     ///< Acceleration limit, ticks/s^2, 0 for constant speed
+        double jerk;      ///< Jerk limit, ticks/s^3, 0 for constant acceleration
+        double dwell;     ///< Time to hold still, s, for a move of 0 steps
+        uint64_t fine;    ///< HYBRID: microsteps at the end of the move to run in MICROSTEP style
+        double v_fine;    ///< HYBRID: velocity of the microstepped parts, microsteps/s
+        uint64_t seq;     ///< Sequence number of the move on the motor, assigned when queued
+    };
+
+    /**
+     * @brief State of a queued move.
+     *
+     */
+    enum MoveResult
+    {
+        MOVE_INVALID = 0, ///< The handle does not refer to a move
+        MOVE_QUEUED,      ///< Waiting for the moves queued before it
+        MOVE_RUNNING,     ///< Being stepped
+        MOVE_DONE,        ///< All steps made
+        MOVE_ABORTED,     ///< Stopped or dropped before all steps were made
+        MOVE_EXPIRED      ///< Finished more than STEPPER_QUEUE_LEN moves ago, the outcome is no longer kept
+    };
+
+    class MoveHandle;
+
+    /**
+     * @brief Completion callback of a queued move. Called from the motion engine
+     * thread once the move is done or aborted; it must not block, but may queue
+     * further moves.
+     *
+     */
+    typedef void (*MoveCallback)(StepperMotor *mot, MoveHandle handle, MoveResult result, void *user);
+
+    /**
+     * @brief Reference to a move queued with {@link Adafruit::StepperMotor::move}.
+     * Handles are small values and can be copied freely.
+     *
+     */
+    class MoveHandle
+    {
+    public:
+        /**
+         * @brief Create a handle that refers to no move.
+         *
+         */
+        MoveHandle();
+
+        /**
+         * @brief Check whether the handle refers to a move.
+         *
+         * @return bool false if the move could not be queued.
+         */
+        bool valid() const;
+
+        /**
+         * @brief Check whether the move has finished, without blocking.
+         *
+         * @return bool true once the move is done or aborted.
+         */
+        bool done() const;
+
+        /**
+         * @brief Wait for the move to finish.
+         *
+         * @param timeout_ms Time to wait in milliseconds, negative to wait indefinitely.
+         * @return bool true if the move has finished, false on timeout or on an invalid handle.
+         */
+        bool wait(int timeout_ms = -1) const;
+
+        /**
+         * @brief Get the state of the move.
+         *
+         * @return MoveResult State of the move.
+         */
+        MoveResult result() const;
+
+        /**
+         * @brief Get the sequence number of the move on its motor. Moves of a motor
+         * run in increasing sequence order.
+         *
+         * @return uint64_t Sequence number, 0 for an invalid handle.
+         */
+        uint64_t id() const;
+
+    private:
+        friend class StepperMotor;
+        friend class MotionEngine;
+        MoveHandle(StepperMotor *mot, uint64_t seq);
+        StepperMotor *mot;
+        uint64_t seq;
+    };
+
+#ifndef _DOXYGEN_
+    /**
+     * @brief Outcome of a move, kept in the slot of the move until the slot is
+     * reused STEPPER_QUEUE_LEN moves later.
+     *
+     */
+    struct MoveStatus
+    {
+        std::atomic<uint64_t> seq; // move the slot belongs to
+        std::atomic<int> result;   // MoveResult
+        MoveCallback cb;
+        void *user;
+    };
+
+    /**
+     * @brief Bounded multi-producer, single-consumer queue of moves (the cell
+     * sequence scheme of D. Vyukov's bounded MPMC queue). Producers reserve a
+     * slot first, so a push never fails; the sequence number of a move is its
+     * queue position, so moves complete in sequence order and the status slots
+     * of outstanding moves never collide.
+     *
+     */
+    class MoveQueue
+    {
+    public:
+        MoveQueue()
+        {
+            for (size_t i = 0; i < STEPPER_QUEUE_LEN; i++)
+            {
+                cells[i].seq.store(i, std::memory_order_relaxed);
+                status[i].seq.store(0, std::memory_order_relaxed);
+                status[i].result.store(MOVE_EXPIRED, std::memory_order_relaxed);
+                status[i].cb = nullptr;
+                status[i].user = nullptr;
+            }
+            enq.store(0, std::memory_order_relaxed);
+            deq.store(0, std::memory_order_relaxed);
+            count.store(0, std::memory_order_relaxed);
+        }
+
+        // claim room for one more outstanding move, false if full
+        bool reserve()
+        {
+            if (count.fetch_add(1, std::memory_order_acq_rel) >= STEPPER_QUEUE_LEN)
+            {
+                count.fetch_sub(1, std::memory_order_acq_rel);
+                return false;
+            }
+            return true;
+        }
+
+        // the move of a reservation has finished
+        void release()
+        {
+            count.fetch_sub(1, std::memory_order_acq_rel);
+        }
+
+        size_t outstanding() const
+        {
+            return count.load(std::memory_order_acquire);
+        }
+
+        // sequence number of the latest move queued (or being queued)
+        uint64_t last() const
+        {
+            return enq.load(std::memory_order_acquire);
+        }
+
+        // queue a move after reserve(), returns its sequence number
+        uint64_t push(const StepperMove &mv, MoveCallback cb, void *user)
+        {
+            uint64_t pos = enq.load(std::memory_order_relaxed);
+            Cell *c;
+            for (;;)
+            {
+                c = &cells[pos & (STEPPER_QUEUE_LEN - 1)];
+                int64_t diff = (int64_t)c->seq.load(std::memory_order_acquire) - (int64_t)pos;
+                if (diff == 0 && enq.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+                else if (diff != 0) // taken by another producer, or (transiently) not yet popped
+                    pos = enq.load(std::memory_order_relaxed);
+            }
+            uint64_t seq = pos + 1;
+            c->mv = mv;
+            c->mv.seq = seq;
+            // the slot's previous move finished STEPPER_QUEUE_LEN moves ago: claim the slot
+            // before resetting the result, handles read the result first and the owner second
+            MoveStatus &st = status[pos & (STEPPER_QUEUE_LEN - 1)];
+            st.seq.store(seq);
+            st.result.store(MOVE_QUEUED);
+            st.cb = cb;
+            st.user = user;
+            c->seq.store(seq, std::memory_order_release); // publish to the consumer
+            return seq;
+        }
+
+        // consumer only: take the oldest move if its sequence number is at most upto, false if empty
+        bool pop(StepperMove &mv, uint64_t upto = UINT64_MAX)
+        {
+            uint64_t pos = deq.load(std::memory_order_relaxed);
+            Cell &c = cells[pos & (STEPPER_QUEUE_LEN - 1)];
+            if (pos + 1 > upto || c.seq.load(std::memory_order_acquire) != pos + 1)
+                return false;
+            mv = c.mv;
+            deq.store(pos + 1, std::memory_order_relaxed);
+            c.seq.store(pos + STEPPER_QUEUE_LEN, std::memory_order_release);
+            return true;
+        }
+
+        MoveStatus &slot(uint64_t seq)
+        {
+            return status[(seq - 1) & (STEPPER_QUEUE_LEN - 1)];
+        }
+
+    private:
+        struct Cell
+        {
+            std::atomic<uint64_t> seq;
+            StepperMove mv;
+        };
+        Cell cells[STEPPER_QUEUE_LEN];
+        MoveStatus status[STEPPER_QUEUE_LEN];
+        std::atomic<uint64_t> enq;
+        std::atomic<uint64_t> deq;
+        std::atomic<size_t> count;
+    };
+#endif // _DOXYGEN_
+};
+
+#endif
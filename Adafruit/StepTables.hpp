@@ -0,0 +1,328 @@
+/**
+ * @file StepTables.hpp
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Compile-time phase tables for stepping the Adafruit Motor Shield V2 steppers.
+ * For every {@link Adafruit::MotorStyle} and {@link Adafruit::MicroSteps} combination,
+ * the phase advance and the phase to (PWMA, PWMB, coil latch) mapping are resolved at
+ * compile time, so that a step is a table lookup followed by a frame write.
+ * @version 2.0.0
+ * @date 2022-03-24
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef _StepTables_hpp_
+#define _StepTables_hpp_
+
+#include <stdint.h>
+
+namespace Adafruit
+{
+    /**
+     * @brief Defines the stepping technique used to actuate stepper motors.
+     *
+     * @var SINGLE
+     * Single coil stepping
+     * @var DOUBLE
+     * Double coil stepping
+     * @var INTERLEAVE
+     * Double coil interleaved stepping
+     * @var MICROSTEP
+     * Microstepping, achieves a smoother motion by dividing a step into smaller 'micro'steps.
+     * @var HYBRID
+     * Double coil steps for the travel and microsteps for the final approach, for queued moves only.
+     */
+    typedef enum : uint8_t
+    {
+        SINGLE = 1,
+        DOUBLE = 2,
+        INTERLEAVE = 3,
+        MICROSTEP = 4,
+        HYBRID = 5
+    } MotorStyle;
+
+    /**
+     * @brief Defines the direction of motor actuation.
+     *
+     */
+    typedef enum : uint8_t
+    {
+        FORWARD = 1,  /*!< Forward direction */
+        BACKWARD = 2, /*!< Backward direction */
+        BRAKE = 3,    /*!< Not used */
+        RELEASE = 4   /*!< Release the motor. */
+        /*!< In case of DC motor, stops running. */
+        /*!< In case of stepper motor, removes stall torque and powers down the coils. */
+    } MotorDir;
+
+    /**
+     * Defines the number of microsteps executed per step
+     * of a stepper motor. Increasing microsteps per step limits
+     * the maximum RPM achievable by a stepper motor due to I2C bus
+     * constraints. Upper limits for each microstep for a 200 steps/revolution,
+     * double coil stepper motor are provided.
+     *
+     */
+    typedef enum : uint16_t
+    {
+        STEP2 = 2,     /*!< 2 microsteps per step, max speed 40 RPM. */
+        STEP4 = 4,     /*!< 4 microsteps per step, max speed 20 RPM. */
+        STEP8 = 8,     /*!< 8 microsteps per step, max speed 10 RPM. */
+        STEP16 = 16,   /*!< 16 microsteps per step, max speed 5 RPM. */
+        STEP32 = 32,   /*!< 32 microsteps per step, max speed 2.5 RPM. */
+        STEP64 = 64,   /*!< 64 microsteps per step, max speed 1.25 RPM. */
+        STEP128 = 128, /*!< 128 microsteps per step, max speed 0.625 RPM. */
+        STEP256 = 256, /*!< 256 microsteps per step, max speed 0.3125 RPM. */
+        STEP512 = 512, /*!< 512 microsteps per step, max speed 0.15625 RPM. */
+        STEP1024 = 1024 /*!< 1024 microsteps per step, max speed 0.078125 RPM. */
+    } MicroSteps;
+
+    /**
+     * @brief Finest microstep resolution supported. Every {@link Adafruit::MicroSteps}
+     * setting indexes the master microstep curve with a stride of MICROSTEP_MAX / microsteps.
+     *
+     */
+    constexpr uint16_t MICROSTEP_MAX = 1024;
+
+#ifndef _DOXYGEN_
+    /**
+     * @brief sin(x) for x in [0, pi/2], usable in constant expressions.
+     *
+     */
+    constexpr double quarterSine(double x)
+    {
+        double term = x, sum = x;
+        for (int k = 1; k < 16; k++)
+        {
+            term *= -x * x / ((2 * k) * (2 * k + 1));
+            sum += term;
+        }
+        return sum;
+    }
+
+    /**
+     * @brief Sinusoidal microstepping curve (sine curve between 0 and pi/2)
+     * for the PWM output (12-bit range), with M + 1 points.
+     * The last point is the beginning of the next step.
+     *
+     * @tparam M Points per quarter period.
+     */
+    template <uint16_t M>
+    struct MicrostepCurveTable
+    {
+        uint16_t value[M + 1];
+
+        constexpr MicrostepCurveTable() : value()
+        {
+            constexpr double half_pi = 1.57079632679489661923;
+            for (uint16_t i = 0; i <= M; i++)
+                value[i] = (uint16_t)(4095 * quarterSine(half_pi * i / M) + 1e-6); // truncated, as the original Adafruit tables
+        }
+    };
+
+    template <uint16_t M>
+    struct MicrostepCurve
+    {
+        static constexpr MicrostepCurveTable<M> table = MicrostepCurveTable<M>();
+    };
+
+    template <uint16_t M>
+    constexpr MicrostepCurveTable<M> MicrostepCurve<M>::table;
+
+    /**
+     * @brief Master microstep curve, MICROSTEP_MAX + 1 points.
+     *
+     */
+    constexpr const uint16_t *microstepcurve = MicrostepCurve<MICROSTEP_MAX>::table.value;
+#endif // _DOXYGEN_
+
+    /**
+     * @brief Point i of the microstep curve for n microsteps per step.
+     *
+     * @param n Microsteps per step, a power of two up to MICROSTEP_MAX.
+     * @param i Curve index, 0 to n.
+     * @return uint16_t PWM duty (0-4095).
+     */
+    constexpr uint16_t microstepCurve(uint16_t n, uint16_t i)
+    {
+        return microstepcurve[i * (MICROSTEP_MAX / n)];
+    }
+
+    /**
+     * @brief Output state of a stepper port at one phase.
+     *
+     */
+    struct StepPhase
+    {
+        uint16_t ocra;  ///< PWMA duty (0-4095)
+        uint16_t ocrb;  ///< PWMB duty (0-4095)
+        uint8_t latch;  ///< Coil bits: 0x1 AIN2, 0x2 BIN1, 0x4 AIN1, 0x8 BIN2
+    };
+
+    /**
+     * @brief Channel offsets of a stepper port within its six-channel frame.
+     * Both ports of the shield use the same layout (LED8-LED13 for port 1,
+     * LED2-LED7 for port 2).
+     *
+     */
+    enum StepFrameChannel : uint8_t
+    {
+        FRAME_PWMA = 0,
+        FRAME_AIN2 = 1,
+        FRAME_AIN1 = 2,
+        FRAME_BIN1 = 3,
+        FRAME_BIN2 = 4,
+        FRAME_PWMB = 5,
+        FRAME_CHANNELS = 6
+    };
+
+#ifndef _DOXYGEN_
+    /**
+     * @brief Coil states of the eight half steps used by the SINGLE, DOUBLE and INTERLEAVE styles.
+     *
+     */
+    constexpr StepPhase halfStepPhases[8] = {
+        {4095, 4095, 0x1}, // energize coil 1 only
+        {4095, 4095, 0x3}, // energize coil 1+2
+        {4095, 4095, 0x2}, // energize coil 2 only
+        {4095, 4095, 0x6}, // energize coil 2+3
+        {4095, 4095, 0x4}, // energize coil 3 only
+        {4095, 4095, 0xC}, // energize coil 3+4
+        {4095, 4095, 0x8}, // energize coil 4 only
+        {4095, 4095, 0x9}, // energize coil 1+4
+    };
+
+    /**
+     * @brief Coils energized in each quarter of the electrical cycle while microstepping.
+     *
+     */
+    constexpr uint8_t quadrantLatch[4] = {0x03, 0x06, 0x0C, 0x09};
+#endif // _DOXYGEN_
+
+    /**
+     * @brief Advance the phase of a motor by one step and look up the outputs for the new phase.
+     *
+     */
+    typedef StepPhase (*StepPhaseFn)(uint16_t &phase, MotorDir dir);
+
+    /**
+     * @brief Phase sequencer for full and half step styles. SINGLE steps land on even
+     * half steps, DOUBLE steps on odd half steps (a misaligned phase is first moved by
+     * half a step), INTERLEAVE moves half a step at a time.
+     *
+     * @tparam style Stepping style.
+     * @tparam N Microsteps per step.
+     */
+    template <MotorStyle style, uint16_t N>
+    struct StepSequence
+    {
+        static_assert(N >= 2 && N <= MICROSTEP_MAX && !(N & (N - 1)), "Microsteps per step must be a power of two");
+
+        static StepPhase next(uint16_t &phase, MotorDir dir)
+        {
+            constexpr uint16_t half = N / 2;
+            uint16_t delta = half;
+            if (style != INTERLEAVE && ((phase / half) & 1) != (style == SINGLE))
+                delta = N;
+            phase = (dir == FORWARD ? phase + delta : phase - delta) & (4 * N - 1);
+            return halfStepPhases[phase / half];
+        }
+    };
+
+    /**
+     * @brief Phase sequencer for microstepping.
+     *
+     * @tparam N Microsteps per step.
+     */
+    template <uint16_t N>
+    struct StepSequence<MICROSTEP, N>
+    {
+        static StepPhase next(uint16_t &phase, MotorDir dir)
+        {
+            constexpr uint16_t stride = MICROSTEP_MAX / N;
+            phase = (dir == FORWARD ? phase + 1 : phase - 1) & (4 * N - 1);
+            uint16_t r = phase & (N - 1);
+            uint16_t a = microstepcurve[r * stride], b = microstepcurve[(N - r) * stride];
+            uint8_t q = phase / N;
+            if (q & 1)
+                return {a, b, quadrantLatch[q]};
+            return {b, a, quadrantLatch[q]};
+        }
+    };
+
+#ifndef _DOXYGEN_
+    template <uint16_t N>
+    inline StepPhaseFn stepPhaseFnN(MotorStyle style)
+    {
+        switch (style)
+        {
+        case SINGLE:
+            return &StepSequence<SINGLE, N>::next;
+        case DOUBLE:
+            return &StepSequence<DOUBLE, N>::next;
+        case INTERLEAVE:
+            return &StepSequence<INTERLEAVE, N>::next;
+        case MICROSTEP:
+            return &StepSequence<MICROSTEP, N>::next;
+        default:
+            return nullptr;
+        }
+    }
+#endif // _DOXYGEN_
+
+    /**
+     * @brief Get the phase sequencer for a stepping style and microstep setting.
+     *
+     * @param style Stepping style.
+     * @param microsteps Microsteps per step.
+     * @return StepPhaseFn Sequencer, nullptr if the combination is not valid.
+     */
+    inline StepPhaseFn stepPhaseFn(MotorStyle style, MicroSteps microsteps)
+    {
+        switch (microsteps)
+        {
+#ifndef _DOXYGEN_
+#define MCASE(x)  \
+    case STEP##x: \
+        return stepPhaseFnN<x>(style);
+#endif // _DOXYGEN_
+            MCASE(2)
+            MCASE(4)
+            MCASE(8)
+            MCASE(16)
+            MCASE(32)
+            MCASE(64)
+            MCASE(128)
+            MCASE(256)
+            MCASE(512)
+            MCASE(1024)
+#undef MCASE
+        default:
+            return nullptr;
+        }
+    }
+
+    /**
+     * @brief Fill the six-channel LEDn_ON/LEDn_OFF frame of a stepper port from a phase.
+     *
+     * @param ph Phase to output.
+     * @param on LEDn_ON values, indexed by {@link Adafruit::StepFrameChannel}.
+     * @param off LEDn_OFF values, indexed by {@link Adafruit::StepFrameChannel}.
+     */
+    inline void stepFrame(const StepPhase &ph, uint16_t on[FRAME_CHANNELS], uint16_t off[FRAME_CHANNELS])
+    {
+        // ocra/ocrb never exceed 4095, coil pins are full on (4096) or off
+        on[FRAME_PWMA] = 0;
+        off[FRAME_PWMA] = ph.ocra;
+        on[FRAME_PWMB] = 0;
+        off[FRAME_PWMB] = ph.ocrb;
+        on[FRAME_AIN2] = ph.latch & 0x1 ? 4096 : 0;
+        on[FRAME_BIN1] = ph.latch & 0x2 ? 4096 : 0;
+        on[FRAME_AIN1] = ph.latch & 0x4 ? 4096 : 0;
+        on[FRAME_BIN2] = ph.latch & 0x8 ? 4096 : 0;
+        off[FRAME_AIN2] = off[FRAME_BIN1] = off[FRAME_AIN1] = off[FRAME_BIN2] = 0;
+    }
+};
+
+#endif // _StepTables_hpp_
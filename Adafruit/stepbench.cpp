@@ -0,0 +1,354 @@
+/**
+ * @file stepbench.cpp
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Microbenchmark for step frame generation. Compares the runtime phase
+ * arithmetic that StepperMotor::onestep used to do against the compile-time
+ * phase tables in StepTables.hpp, and checks that both produce the same frames
+ * and that the master microstep curve reproduces the curves onestep used to have.
+ * @version 2.0.0
+ * @date 2022-03-24
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "StepTables.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+using namespace Adafruit;
+
+static inline uint64_t get_timestamp()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000000LLU + ts.tv_nsec);
+}
+
+/**
+ * @brief Sinusoidal microstepping curves (sine curve between 0 and pi/2) as
+ * onestep used them before the phase tables, n + 1 points for n microsteps.
+ *
+ */
+static const uint16_t legacyCurve8[] = {0, 798, 1567, 2275, 2895,
+                                        3404, 3783, 4016, 4095};
+
+static const uint16_t legacyCurve16[] = {0, 401, 798, 1188, 1567, 1930, 2275, 2597, 2895, 3165, 3404,
+                                         3611, 3783, 3918, 4016, 4075, 4095};
+
+static const uint16_t legacyCurve32[] = {0, 200, 401, 600, 798, 995, 1188, 1379, 1567, 1750, 1930,
+                                         2105, 2275, 2439, 2597, 2750, 2895, 3034, 3165, 3289, 3404, 3512,
+                                         3611, 3701, 3783, 3855, 3918, 3972, 4016, 4050, 4075, 4090, 4095};
+
+static const uint16_t legacyCurve64[] = {0, 100, 200, 301, 401, 501, 600, 700, 798, 897, 995,
+                                         1092, 1188, 1284, 1379, 1473, 1567, 1659, 1750, 1841, 1930, 2018,
+                                         2105, 2190, 2275, 2357, 2439, 2519, 2597, 2674, 2750, 2823, 2895,
+                                         2965, 3034, 3100, 3165, 3228, 3289, 3348, 3404, 3459, 3512, 3563,
+                                         3611, 3657, 3701, 3743, 3783, 3820, 3855, 3888, 3918, 3946, 3972,
+                                         3995, 4016, 4034, 4050, 4064, 4075, 4083, 4090, 4093, 4095};
+
+static const uint16_t legacyCurve128[] = {0, 50, 100, 150, 200, 251, 301, 351, 401, 451, 501,
+                                          551, 600, 650, 700, 749, 798, 848, 897, 946, 995, 1043,
+                                          1092, 1140, 1188, 1236, 1284, 1332, 1379, 1426, 1473, 1520, 1567,
+                                          1613, 1659, 1705, 1750, 1796, 1841, 1885, 1930, 1974, 2018, 2061,
+                                          2105, 2148, 2190, 2233, 2275, 2316, 2357, 2398, 2439, 2479, 2519,
+                                          2558, 2597, 2636, 2674, 2712, 2750, 2787, 2823, 2859, 2895, 2930,
+                                          2965, 3000, 3034, 3067, 3100, 3133, 3165, 3197, 3228, 3258, 3289,
+                                          3318, 3348, 3376, 3404, 3432, 3459, 3486, 3512, 3537, 3563, 3587,
+                                          3611, 3634, 3657, 3680, 3701, 3723, 3743, 3763, 3783, 3802, 3820,
+                                          3838, 3855, 3872, 3888, 3903, 3918, 3932, 3946, 3959, 3972, 3984,
+                                          3995, 4006, 4016, 4025, 4034, 4042, 4050, 4057, 4064, 4070, 4075,
+                                          4079, 4083, 4087, 4090, 4092, 4093, 4094, 4095};
+
+static const uint16_t legacyCurve256[] = {
+    0, 25, 50, 75, 100, 125, 150, 175, 200, 226, 251,
+    276, 301, 326, 351, 376, 401, 426, 451, 476, 501, 526,
+    551, 575, 600, 625, 650, 675, 700, 724, 749, 774, 798,
+    823, 848, 872, 897, 921, 946, 970, 995, 1019, 1043, 1067,
+    1092, 1116, 1140, 1164, 1188, 1212, 1236, 1260, 1284, 1308, 1332,
+    1355, 1379, 1403, 1426, 1450, 1473, 1497, 1520, 1543, 1567, 1590,
+    1613, 1636, 1659, 1682, 1705, 1728, 1750, 1773, 1796, 1818, 1841,
+    1863, 1885, 1908, 1930, 1952, 1974, 1996, 2018, 2040, 2061, 2083,
+    2105, 2126, 2148, 2169, 2190, 2212, 2233, 2254, 2275, 2295, 2316,
+    2337, 2357, 2378, 2398, 2419, 2439, 2459, 2479, 2499, 2519, 2539,
+    2558, 2578, 2597, 2617, 2636, 2655, 2674, 2693, 2712, 2731, 2750,
+    2768, 2787, 2805, 2823, 2841, 2859, 2877, 2895, 2913, 2930, 2948,
+    2965, 2983, 3000, 3017, 3034, 3051, 3067, 3084, 3100, 3117, 3133,
+    3149, 3165, 3181, 3197, 3212, 3228, 3243, 3258, 3274, 3289, 3304,
+    3318, 3333, 3348, 3362, 3376, 3390, 3404, 3418, 3432, 3446, 3459,
+    3473, 3486, 3499, 3512, 3525, 3537, 3550, 3563, 3575, 3587, 3599,
+    3611, 3623, 3634, 3646, 3657, 3668, 3680, 3691, 3701, 3712, 3723,
+    3733, 3743, 3753, 3763, 3773, 3783, 3792, 3802, 3811, 3820, 3829,
+    3838, 3847, 3855, 3864, 3872, 3880, 3888, 3896, 3903, 3911, 3918,
+    3925, 3932, 3939, 3946, 3953, 3959, 3966, 3972, 3978, 3984, 3989,
+    3995, 4000, 4006, 4011, 4016, 4021, 4025, 4030, 4034, 4038, 4042,
+    4046, 4050, 4054, 4057, 4061, 4064, 4067, 4070, 4072, 4075, 4077,
+    4079, 4081, 4083, 4085, 4087, 4088, 4090, 4091, 4092, 4093, 4093,
+    4094, 4094, 4094, 4095};
+
+static const uint16_t legacyCurve512[] = {
+    0, 12, 25, 37, 50, 62, 75, 87, 100, 113, 125,
+    138, 150, 163, 175, 188, 200, 213, 226, 238, 251, 263,
+    276, 288, 301, 313, 326, 338, 351, 363, 376, 388, 401,
+    413, 426, 438, 451, 463, 476, 488, 501, 513, 526, 538,
+    551, 563, 575, 588, 600, 613, 625, 638, 650, 662, 675,
+    687, 700, 712, 724, 737, 749, 761, 774, 786, 798, 811,
+    823, 835, 848, 860, 872, 884, 897, 909, 921, 933, 946,
+    958, 970, 982, 995, 1007, 1019, 1031, 1043, 1055, 1067, 1080,
+    1092, 1104, 1116, 1128, 1140, 1152, 1164, 1176, 1188, 1200, 1212,
+    1224, 1236, 1248, 1260, 1272, 1284, 1296, 1308, 1320, 1332, 1344,
+    1355, 1367, 1379, 1391, 1403, 1414, 1426, 1438, 1450, 1462, 1473,
+    1485, 1497, 1508, 1520, 1532, 1543, 1555, 1567, 1578, 1590, 1601,
+    1613, 1624, 1636, 1647, 1659, 1670, 1682, 1693, 1705, 1716, 1728,
+    1739, 1750, 1762, 1773, 1784, 1796, 1807, 1818, 1829, 1841, 1852,
+    1863, 1874, 1885, 1897, 1908, 1919, 1930, 1941, 1952, 1963, 1974,
+    1985, 1996, 2007, 2018, 2029, 2040, 2051, 2061, 2072, 2083, 2094,
+    2105, 2116, 2126, 2137, 2148, 2158, 2169, 2180, 2190, 2201, 2212,
+    2222, 2233, 2243, 2254, 2264, 2275, 2285, 2295, 2306, 2316, 2327,
+    2337, 2347, 2357, 2368, 2378, 2388, 2398, 2409, 2419, 2429, 2439,
+    2449, 2459, 2469, 2479, 2489, 2499, 2509, 2519, 2529, 2539, 2548,
+    2558, 2568, 2578, 2588, 2597, 2607, 2617, 2626, 2636, 2646, 2655,
+    2665, 2674, 2684, 2693, 2703, 2712, 2721, 2731, 2740, 2750, 2759,
+    2768, 2777, 2787, 2796, 2805, 2814, 2823, 2832, 2841, 2850, 2859,
+    2868, 2877, 2886, 2895, 2904, 2913, 2922, 2930, 2939, 2948, 2957,
+    2965, 2974, 2983, 2991, 3000, 3008, 3017, 3025, 3034, 3042, 3051,
+    3059, 3067, 3076, 3084, 3092, 3100, 3108, 3117, 3125, 3133, 3141,
+    3149, 3157, 3165, 3173, 3181, 3189, 3197, 3204, 3212, 3220, 3228,
+    3235, 3243, 3251, 3258, 3266, 3274, 3281, 3289, 3296, 3304, 3311,
+    3318, 3326, 3333, 3340, 3348, 3355, 3362, 3369, 3376, 3383, 3390,
+    3397, 3404, 3411, 3418, 3425, 3432, 3439, 3446, 3452, 3459, 3466,
+    3473, 3479, 3486, 3492, 3499, 3505, 3512, 3518, 3525, 3531, 3537,
+    3544, 3550, 3556, 3563, 3569, 3575, 3581, 3587, 3593, 3599, 3605,
+    3611, 3617, 3623, 3629, 3634, 3640, 3646, 3652, 3657, 3663, 3668,
+    3674, 3680, 3685, 3691, 3696, 3701, 3707, 3712, 3717, 3723, 3728,
+    3733, 3738, 3743, 3748, 3753, 3758, 3763, 3768, 3773, 3778, 3783,
+    3788, 3792, 3797, 3802, 3806, 3811, 3816, 3820, 3825, 3829, 3834,
+    3838, 3842, 3847, 3851, 3855, 3859, 3864, 3868, 3872, 3876, 3880,
+    3884, 3888, 3892, 3896, 3899, 3903, 3907, 3911, 3915, 3918, 3922,
+    3925, 3929, 3932, 3936, 3939, 3943, 3946, 3949, 3953, 3956, 3959,
+    3962, 3966, 3969, 3972, 3975, 3978, 3981, 3984, 3987, 3989, 3992,
+    3995, 3998, 4000, 4003, 4006, 4008, 4011, 4013, 4016, 4018, 4021,
+    4023, 4025, 4028, 4030, 4032, 4034, 4036, 4038, 4040, 4042, 4044,
+    4046, 4048, 4050, 4052, 4054, 4056, 4057, 4059, 4061, 4062, 4064,
+    4065, 4067, 4068, 4070, 4071, 4072, 4074, 4075, 4076, 4077, 4078,
+    4079, 4080, 4081, 4082, 4083, 4084, 4085, 4086, 4087, 4088, 4088,
+    4089, 4090, 4090, 4091, 4091, 4092, 4092, 4093, 4093, 4093, 4094,
+    4094, 4094, 4094, 4094, 4094, 4094, 4095};
+
+/**
+ * @brief Microstep curve used by onestep before the phase tables.
+ *
+ * @param microsteps Microsteps per step.
+ * @return const uint16_t* Curve, nullptr for settings that had none.
+ */
+static const uint16_t *legacyCurve(uint16_t microsteps)
+{
+    switch (microsteps)
+    {
+    case 8:
+        return legacyCurve8;
+    case 16:
+        return legacyCurve16;
+    case 32:
+        return legacyCurve32;
+    case 64:
+        return legacyCurve64;
+    case 128:
+        return legacyCurve128;
+    case 256:
+        return legacyCurve256;
+    case 512:
+        return legacyCurve512;
+    default:
+        return nullptr;
+    }
+}
+
+/**
+ * @brief Frame generation as done by onestep before the phase tables.
+ *
+ */
+static void legacyStep(uint16_t &currentstep, uint16_t microsteps, MotorDir dir, MotorStyle style, uint16_t on[FRAME_CHANNELS], uint16_t off[FRAME_CHANNELS])
+{
+    const uint16_t *microstepcurve = legacyCurve(microsteps);
+    uint16_t ocrb, ocra;
+
+    ocra = ocrb = 4095;
+
+    if (style == SINGLE)
+    {
+        if ((currentstep / (microsteps / 2)) % 2)
+            currentstep += dir == FORWARD ? microsteps / 2 : -microsteps / 2;
+        else
+            currentstep += dir == FORWARD ? microsteps : -microsteps;
+    }
+    else if (style == DOUBLE)
+    {
+        if (!(currentstep / (microsteps / 2) % 2))
+            currentstep += dir == FORWARD ? microsteps / 2 : -microsteps / 2;
+        else
+            currentstep += dir == FORWARD ? microsteps : -microsteps;
+    }
+    else if (style == INTERLEAVE)
+    {
+        currentstep += dir == FORWARD ? microsteps / 2 : -microsteps / 2;
+    }
+
+    if (style == MICROSTEP)
+    {
+        if (dir == FORWARD)
+            currentstep++;
+        else
+            currentstep--;
+
+        currentstep += microsteps * 4;
+        currentstep %= microsteps * 4;
+
+        ocra = ocrb = 0;
+        if (currentstep < microsteps)
+        {
+            ocra = microstepcurve[microsteps - currentstep];
+            ocrb = microstepcurve[currentstep];
+        }
+        else if ((currentstep >= microsteps) && (currentstep < microsteps * 2))
+        {
+            ocra = microstepcurve[currentstep - microsteps];
+            ocrb = microstepcurve[microsteps * 2 - currentstep];
+        }
+        else if ((currentstep >= microsteps * 2) && (currentstep < microsteps * 3))
+        {
+            ocra = microstepcurve[microsteps * 3 - currentstep];
+            ocrb = microstepcurve[currentstep - microsteps * 2];
+        }
+        else if ((currentstep >= microsteps * 3) && (currentstep < microsteps * 4))
+        {
+            ocra = microstepcurve[currentstep - microsteps * 3];
+            ocrb = microstepcurve[microsteps * 4 - currentstep];
+        }
+    }
+
+    currentstep += microsteps * 4;
+    currentstep %= microsteps * 4;
+
+    uint8_t latch_state = 0;
+    if (style == MICROSTEP)
+    {
+        if (currentstep < microsteps)
+            latch_state |= 0x03;
+        if ((currentstep >= microsteps) && (currentstep < microsteps * 2))
+            latch_state |= 0x06;
+        if ((currentstep >= microsteps * 2) && (currentstep < microsteps * 3))
+            latch_state |= 0x0C;
+        if ((currentstep >= microsteps * 3) && (currentstep < microsteps * 4))
+            latch_state |= 0x09;
+    }
+    else
+    {
+        static const uint8_t latch[8] = {0x1, 0x3, 0x2, 0x6, 0x4, 0xC, 0x8, 0x9};
+        latch_state = latch[currentstep / (microsteps / 2)];
+    }
+
+    on[FRAME_PWMA] = ocra > 4095 ? 4096 : 0;
+    off[FRAME_PWMA] = ocra > 4095 ? 0 : ocra;
+    on[FRAME_PWMB] = ocrb > 4095 ? 4096 : 0;
+    off[FRAME_PWMB] = ocrb > 4095 ? 0 : ocrb;
+    on[FRAME_AIN2] = latch_state & 0x1 ? 4096 : 0;
+    on[FRAME_BIN1] = latch_state & 0x2 ? 4096 : 0;
+    on[FRAME_AIN1] = latch_state & 0x4 ? 4096 : 0;
+    on[FRAME_BIN2] = latch_state & 0x8 ? 4096 : 0;
+    off[FRAME_AIN2] = off[FRAME_BIN1] = off[FRAME_AIN1] = off[FRAME_BIN2] = 0;
+}
+
+static volatile uint32_t sink;
+
+static void sinkFrame(const uint16_t *on, const uint16_t *off)
+{
+    uint32_t acc = 0;
+    for (int i = 0; i < FRAME_CHANNELS; i++)
+        acc += on[i] ^ off[i];
+    sink = sink + acc;
+}
+
+int main(int argc, char *argv[])
+{
+    long iters = 10000000;
+    if (argc > 1)
+        iters = atol(argv[1]);
+    if (iters <= 0)
+    {
+        printf("Usage: ./stepbench.out [steps per measurement]\n\n");
+        return 0;
+    }
+    const MotorStyle styles[] = {SINGLE, DOUBLE, INTERLEAVE, MICROSTEP};
+    const char *style_names[] = {"SINGLE", "DOUBLE", "INTERLEAVE", "MICROSTEP"};
+    const MicroSteps msteps[] = {STEP2, STEP4, STEP8, STEP16, STEP32, STEP64, STEP128, STEP256, STEP512, STEP1024};
+    bool mismatch = false;
+
+    // the master curve reproduces every curve that onestep had
+    for (uint16_t n = 8; n <= 512 && !mismatch; n *= 2)
+    {
+        for (uint16_t i = 0; i <= n; i++)
+        {
+            if (microstepCurve(n, i) != legacyCurve(n)[i])
+            {
+                printf("Mismatch: curve %u point %u: %u vs %u\n", n, i, microstepCurve(n, i), legacyCurve(n)[i]);
+                mismatch = true;
+                break;
+            }
+        }
+    }
+
+    printf("%-10s %6s %12s %12s %8s\n", "Style", "Steps", "Legacy ns", "Table ns", "Speedup");
+    for (int s = 0; s < 4; s++)
+    {
+        for (unsigned m = 0; m < sizeof(msteps) / sizeof(msteps[0]); m++)
+        {
+            MotorStyle style = styles[s];
+            uint16_t n = msteps[m];
+            if (style == MICROSTEP && legacyCurve(n) == nullptr)
+                continue; // no curve before the phase tables: nothing to compare with
+            StepPhaseFn fn = stepPhaseFn(style, msteps[m]);
+            uint16_t on[FRAME_CHANNELS], off[FRAME_CHANNELS];
+            uint16_t lon[FRAME_CHANNELS], loff[FRAME_CHANNELS];
+
+            // check: both paths agree over two electrical cycles in both directions, from every start phase
+            for (uint16_t start = 0; start < 4 * n && !mismatch; start++)
+            {
+                uint16_t p0 = start, p1 = start;
+                for (int i = 0; i < 16 * n; i++)
+                {
+                    MotorDir dir = i < 8 * n ? FORWARD : BACKWARD;
+                    legacyStep(p0, n, dir, style, lon, loff);
+                    stepFrame(fn(p1, dir), on, off);
+                    if (p0 != p1 || memcmp(on, lon, sizeof(on)) || memcmp(off, loff, sizeof(off)))
+                    {
+                        printf("Mismatch: %s/%u start %u step %d: phase %u vs %u\n", style_names[s], n, start, i, p0, p1);
+                        mismatch = true;
+                        break;
+                    }
+                }
+            }
+
+            uint16_t phase = 0;
+            uint64_t t0 = get_timestamp();
+            for (long i = 0; i < iters; i++)
+            {
+                legacyStep(phase, n, (i & 0x100) ? BACKWARD : FORWARD, style, lon, loff);
+                sinkFrame(lon, loff);
+            }
+            uint64_t t1 = get_timestamp();
+            phase = 0;
+            for (long i = 0; i < iters; i++)
+            {
+                stepFrame(fn(phase, (i & 0x100) ? BACKWARD : FORWARD), on, off);
+                sinkFrame(on, off);
+            }
+            uint64_t t2 = get_timestamp();
+            double legacy = (double)(t1 - t0) / iters, table = (double)(t2 - t1) / iters;
+            printf("%-10s %6u %12.2f %12.2f %7.2fx\n", style_names[s], n, legacy, table, legacy / table);
+        }
+    }
+    return mismatch ? 1 : 0;
+}
@@ -44,6 +44,25 @@ typedef size_t clkgen_t;
  */
 clkgen_t create_clk(unsigned long long int interval_nsec, time_handler handler, void *data);
 
+/**
+ * @brief Create a clock generator instance whose handler is told how many periods
+ * elapsed since its last call, so that a late handler can make up for the missed ones.
+ * 
+ * @param interval_nsec Clock interval in nanoseconds
+ * @param handler Registered handler function, receives the number of expirations (1 when on time)
+ * @param data Any data to be passed to the handler function
+ * @return clkgen_t Instance ID of clock
+ */
+clkgen_t create_clk_ex(unsigned long long int interval_nsec, time_handler_ex handler, void *data);
+
+/**
+ * @brief Get the number of clock periods that elapsed without a handler call of their own
+ * 
+ * @param clkid Clock to query
+ * @return uint64_t Total overruns since the clock was created
+ */
+uint64_t clk_overruns(clkgen_t clkid);
+
 /**
  * @brief Update clock interval of existing clock
  * 
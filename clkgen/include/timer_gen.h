@@ -1,6 +1,7 @@
 #ifndef TIMER_GEN_H
 #define TIMER_GEN_H
 #include <stdlib.h>
+#include <stdint.h>
 
 typedef enum
 {
@@ -11,9 +12,13 @@ TIMER_PERIODIC
 } t_timer;
 
 typedef void (*time_handler)(size_t timer_id, void * user_data);
+/* expirations: periods elapsed since the last call, more than 1 if the handler ran late */
+typedef void (*time_handler_ex)(size_t timer_id, uint64_t expirations, void * user_data);
 
 int     initialize();
 size_t  start_timer(unsigned long long int interval, time_handler handler, t_timer type, void * user_data);
+size_t  start_timer_ex(unsigned long long int interval, time_handler_ex handler, t_timer type, void * user_data);
+uint64_t timer_overruns(size_t timer_id);
 size_t  update_timer(size_t timer_id, unsigned long long int interval, t_timer type);
 void    stop_timer(size_t timer_id);
 void    finalize();
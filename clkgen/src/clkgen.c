@@ -15,21 +15,40 @@
 
 static unsigned long long int __clkgen_num_clks = 0;
 
-clkgen_t create_clk(unsigned long long int interval_nsec, time_handler handler, void *data)
+static int clkgen_init(const char *func)
 {
     if (__clkgen_num_clks == 0)
     {
         if (initialize() < 0)
         {
-            eprintf("%s: Initialization failed, exiting... Err:", __func__);
+            eprintf("%s: Initialization failed, exiting... Err:", func);
             perror(" ");
             return -1;
         }
     }
     __clkgen_num_clks++;
+    return 1;
+}
+
+clkgen_t create_clk(unsigned long long int interval_nsec, time_handler handler, void *data)
+{
+    if (clkgen_init(__func__) < 0)
+        return -1;
     return start_timer(interval_nsec, handler, TIMER_PERIODIC, data);
 }
 
+clkgen_t create_clk_ex(unsigned long long int interval_nsec, time_handler_ex handler, void *data)
+{
+    if (clkgen_init(__func__) < 0)
+        return -1;
+    return start_timer_ex(interval_nsec, handler, TIMER_PERIODIC, data);
+}
+
+uint64_t clk_overruns(clkgen_t clkid)
+{
+    return timer_overruns(clkid);
+}
+
 clkgen_t update_clk(clkgen_t clkid, unsigned long long int interval_nsec)
 {
     return update_timer(clkid, interval_nsec, TIMER_PERIODIC);
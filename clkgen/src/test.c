@@ -10,6 +10,13 @@ void time_handler1(clkgen_t timer_id, void * user_data)
     *(int *) user_data = !(*(int *) user_data);
 }
 
+void time_handler2(clkgen_t timer_id, uint64_t expirations, void * user_data)
+{
+    if (expirations > 1)
+        printf("Periodic timer 0x%lx: %lu periods missed\n", timer_id, (unsigned long) (expirations - 1));
+    *(uint64_t *) user_data += expirations;
+}
+
 int main(int argc, char *argv[])
 {
     if (argc != 2)
@@ -29,10 +36,14 @@ int main(int argc, char *argv[])
         printf("Invalid half period 0 ns, exiting...\n");
         return 0;
     }
+    static uint64_t ticks = 0;
     clkgen_t clkgen = create_clk(halfperiod, time_handler1, &clk);
+    clkgen_t counter = create_clk_ex(halfperiod, time_handler2, &ticks);
     sleep(5);
     clkgen = update_clk(clkgen, halfperiod >> 1);
     sleep(5 / 2);
+    printf("Counter clock: %lu periods, %lu overruns\n", (unsigned long) ticks, (unsigned long) clk_overruns(counter));
+    destroy_clk(counter);
     destroy_clk(clkgen);
     return 0;
 }
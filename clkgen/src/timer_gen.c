@@ -21,6 +21,7 @@ struct timer_node
 #ifndef __APPLE__
     int fd;
     time_handler callback;
+    time_handler_ex callback_ex;
     void *user_data;
     unsigned long long int interval;
     t_timer type;
@@ -28,6 +29,7 @@ struct timer_node
     bool active;
     dispatch_source_t timer;
 #endif
+    volatile uint64_t overruns; // expirations that did not get a handler call of their own
     struct timer_node *next;
 };
 
@@ -66,7 +68,7 @@ int initialize()
 #endif
 }
 
-size_t start_timer(unsigned long long int interval, time_handler handler, t_timer type, void *user_data)
+static size_t _start_timer(unsigned long long int interval, time_handler handler, time_handler_ex handler_ex, t_timer type, void *user_data)
 {
     struct timer_node *new_node = NULL;
 
@@ -75,10 +77,12 @@ size_t start_timer(unsigned long long int interval, time_handler handler, t_time
     if (new_node == NULL)
         return 0;
 
+    new_node->overruns = 0;
 #ifndef __APPLE__
     struct itimerspec new_value;
 
     new_node->callback = handler;
+    new_node->callback_ex = handler_ex;
     new_node->user_data = user_data;
     new_node->interval = interval;
     new_node->type = type;
@@ -109,7 +113,13 @@ size_t start_timer(unsigned long long int interval, time_handler handler, t_time
 #else
     new_node->timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, queue);
     dispatch_source_set_event_handler(new_node->timer, ^{
-      handler((size_t)new_node, user_data);
+      uint64_t exp = dispatch_source_get_data(new_node->timer); // fires since the last call
+      if (exp > 1)
+          new_node->overruns += exp - 1;
+      if (handler_ex)
+          handler_ex((size_t)new_node, exp ? exp : 1, user_data);
+      else
+          handler((size_t)new_node, user_data);
     });
     dispatch_source_set_cancel_handler(new_node->timer, ^{
       dispatch_release(new_node->timer);
@@ -127,6 +137,24 @@ size_t start_timer(unsigned long long int interval, time_handler handler, t_time
     return (size_t)new_node;
 }
 
+size_t start_timer(unsigned long long int interval, time_handler handler, t_timer type, void *user_data)
+{
+    return _start_timer(interval, handler, NULL, type, user_data);
+}
+
+size_t start_timer_ex(unsigned long long int interval, time_handler_ex handler, t_timer type, void *user_data)
+{
+    return _start_timer(interval, NULL, handler, type, user_data);
+}
+
+uint64_t timer_overruns(size_t timer_id)
+{
+    struct timer_node *node = (struct timer_node *)timer_id;
+    if (node == NULL)
+        return 0;
+    return node->overruns;
+}
+
 size_t update_timer(size_t timer_id, unsigned long long interval, t_timer type)
 {
     struct timer_node *node = (struct timer_node *)timer_id;
@@ -265,7 +293,13 @@ void *_timer_thread(void *data)
 
                 tmp = _get_timer_from_fd(ufds[i].fd);
 
-                if (tmp && tmp->callback)
+                if (tmp == NULL)
+                    continue;
+                if (exp > 1) // the thread was late, periods went by without a call
+                    tmp->overruns += exp - 1;
+                if (tmp->callback_ex)
+                    tmp->callback_ex((size_t)tmp, exp, tmp->user_data);
+                else if (tmp->callback)
                     tmp->callback((size_t)tmp, tmp->user_data);
             }
         }
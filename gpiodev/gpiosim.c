@@ -0,0 +1,318 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "gpiosim.h"
+
+#ifdef eprintf
+#undef eprintf
+#endif
+
+#define eprintf(str, ...)                                                                       \
+    {                                                                                           \
+        fprintf(stderr, "[%s/%s():%d] " str "\n", __FILE__, __func__, __LINE__, ##__VA_ARGS__); \
+        fflush(stderr);                                                                         \
+    }
+
+/**
+ * @brief State of one simulated pin.
+ *
+ */
+typedef struct
+{
+    int mode;              // GPIO_MODE, GPIO_IN until set
+    int pud;               // GPIO_PUD
+    int level;             // input level set with gpiosim_set_input
+    int out;               // level last written
+    uint64_t writes;       // gpioWrite calls
+    uint64_t rises, falls; // edges of the input level
+    gpiosim_input_fn fn;   // level source, NULL for level
+    void *user;            // user data of fn
+    int irq_run;           // IRQ thread running
+    pthread_t irq_thread;  // runs the registered callback
+    gpio_irq_callback_t callback;
+    void *userdata;
+    int tout_ms;
+} sim_pin;
+
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER; /// Guards all pins
+static pthread_cond_t sim_edge = PTHREAD_COND_INITIALIZER;   /// Broadcast on every edge and IRQ unregistration
+static sim_pin sim_pins[GPIOSIM_MAX_PINS];
+
+static inline int sim_valid(int pin)
+{
+    if (pin < 0 || pin >= GPIOSIM_MAX_PINS)
+    {
+        eprintf("Invalid pin %d", pin);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Count the edges of a pin that an IRQ mode reacts to. Called with sim_lock held.
+ *
+ */
+static inline uint64_t sim_edges(const sim_pin *p, enum GPIO_MODE mode)
+{
+    if (mode == GPIO_IRQ_RISE)
+        return p->rises;
+    if (mode == GPIO_IRQ_FALL)
+        return p->falls;
+    return p->rises + p->falls;
+}
+
+int gpioInitialize(void)
+{
+    return 1;
+}
+
+void gpioDestroy(void)
+{
+}
+
+int gpioSetMode(int pin, enum GPIO_MODE mode)
+{
+    if (!sim_valid(pin))
+        return -1;
+    pthread_mutex_lock(&sim_lock);
+    sim_pins[pin].mode = mode;
+    pthread_mutex_unlock(&sim_lock);
+    return 1;
+}
+
+int gpioGetMode(int pin)
+{
+    if (!sim_valid(pin))
+        return -1;
+    pthread_mutex_lock(&sim_lock);
+    int mode = sim_pins[pin].mode;
+    pthread_mutex_unlock(&sim_lock);
+    return mode;
+}
+
+int gpioSetPullUpDown(int pin, enum GPIO_PUD pud)
+{
+    if (!sim_valid(pin))
+        return -1;
+    pthread_mutex_lock(&sim_lock);
+    sim_pins[pin].pud = pud;
+    pthread_mutex_unlock(&sim_lock);
+    return 1;
+}
+
+int gpioWrite(int pin, int val)
+{
+    if (!sim_valid(pin))
+        return -1;
+    pthread_mutex_lock(&sim_lock);
+    sim_pin *p = &sim_pins[pin];
+    int ret = 0;
+    if (p->mode != GPIO_OUT)
+    {
+        eprintf("Pin %d is not an output", pin);
+        ret = -1;
+    }
+    else
+    {
+        p->out = val == GPIO_LOW ? GPIO_LOW : GPIO_HIGH;
+        p->writes++;
+    }
+    pthread_mutex_unlock(&sim_lock);
+    return ret;
+}
+
+int gpioRead(int pin)
+{
+    if (!sim_valid(pin))
+        return -1;
+    pthread_mutex_lock(&sim_lock);
+    sim_pin *p = &sim_pins[pin];
+    gpiosim_input_fn fn = p->mode == GPIO_OUT ? NULL : p->fn;
+    void *user = p->user;
+    int val = p->mode == GPIO_OUT ? p->out : p->level;
+    pthread_mutex_unlock(&sim_lock);
+    if (fn != NULL) // outside the lock: the source may take locks of its own
+        val = fn(pin, user) == GPIO_LOW ? GPIO_LOW : GPIO_HIGH;
+    return val;
+}
+
+int gpioWaitIRQ(int pin, enum GPIO_MODE mode, int tout_ms)
+{
+    if (!sim_valid(pin))
+        return -1;
+    if (mode < GPIO_IRQ_FALL || mode > GPIO_IRQ_BOTH)
+    {
+        eprintf("IRQ mode value %d on pin %d, not supported", mode, pin);
+        return -1;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if (tout_ms >= 0)
+    {
+        ts.tv_sec += tout_ms / 1000;
+        ts.tv_nsec += (tout_ms % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L)
+        {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+    }
+    pthread_mutex_lock(&sim_lock);
+    sim_pin *p = &sim_pins[pin];
+    uint64_t seen = sim_edges(p, mode);
+    int rc = 0;
+    while (sim_edges(p, mode) == seen && rc != ETIMEDOUT)
+    {
+        if (p->callback != NULL && !p->irq_run) // unregistered while the IRQ thread waits
+            break;
+        rc = tout_ms < 0 ? pthread_cond_wait(&sim_edge, &sim_lock) : pthread_cond_timedwait(&sim_edge, &sim_lock, &ts);
+    }
+    int ret = (int)(sim_edges(p, mode) - seen);
+    pthread_mutex_unlock(&sim_lock);
+    return ret;
+}
+
+/**
+ * @brief Run the callback of a registered IRQ on every matching edge until
+ * the IRQ is unregistered.
+ *
+ */
+static void *sim_irq_thread(void *arg)
+{
+    sim_pin *p = (sim_pin *)arg;
+    int pin = p - sim_pins;
+    while (1)
+    {
+        pthread_mutex_lock(&sim_lock);
+        int run = p->irq_run, mode = p->mode, tout_ms = p->tout_ms;
+        gpio_irq_callback_t callback = p->callback;
+        void *userdata = p->userdata;
+        pthread_mutex_unlock(&sim_lock);
+        if (!run)
+            break;
+        if (gpioWaitIRQ(pin, mode, tout_ms) > 0)
+            callback(userdata);
+    }
+    return NULL;
+}
+
+int gpioRegisterIRQ(int pin, enum GPIO_MODE mode, gpio_irq_callback_t func, void *userdata, int tout_ms)
+{
+    if (!sim_valid(pin))
+        return -1;
+    if (mode < GPIO_IRQ_FALL || mode > GPIO_IRQ_BOTH || func == NULL)
+    {
+        eprintf("IRQ mode value %d on pin %d, not supported", mode, pin);
+        return -1;
+    }
+    pthread_mutex_lock(&sim_lock);
+    sim_pin *p = &sim_pins[pin];
+    if (p->irq_run)
+    {
+        pthread_mutex_unlock(&sim_lock);
+        eprintf("IRQ already registered on pin %d", pin);
+        return -1;
+    }
+    p->mode = mode;
+    p->callback = func;
+    p->userdata = userdata;
+    p->tout_ms = tout_ms;
+    p->irq_run = 1;
+    int rc = pthread_create(&p->irq_thread, NULL, &sim_irq_thread, p);
+    if (rc)
+    {
+        p->irq_run = 0;
+        p->callback = NULL;
+    }
+    pthread_mutex_unlock(&sim_lock);
+    if (rc)
+    {
+        eprintf("Error creating IRQ thread for pin %d, error %d", pin, rc);
+        return -1;
+    }
+    return 1;
+}
+
+int gpioUnregisterIRQ(int pin)
+{
+    if (!sim_valid(pin))
+        return -1;
+    pthread_mutex_lock(&sim_lock);
+    sim_pin *p = &sim_pins[pin];
+    if (!p->irq_run)
+    {
+        pthread_mutex_unlock(&sim_lock);
+        eprintf("No IRQ registered on pin, exiting");
+        return 0;
+    }
+    p->irq_run = 0;
+    pthread_cond_broadcast(&sim_edge);
+    pthread_mutex_unlock(&sim_lock);
+    pthread_join(p->irq_thread, NULL);
+    pthread_mutex_lock(&sim_lock);
+    p->callback = NULL;
+    p->mode = GPIO_IN;
+    pthread_mutex_unlock(&sim_lock);
+    return 1;
+}
+
+int gpiosim_set_input(int pin, int val)
+{
+    if (!sim_valid(pin))
+        return -1;
+    val = val == GPIO_LOW ? GPIO_LOW : GPIO_HIGH;
+    pthread_mutex_lock(&sim_lock);
+    sim_pin *p = &sim_pins[pin];
+    if (val != p->level)
+    {
+        if (val == GPIO_HIGH)
+            p->rises++;
+        else
+            p->falls++;
+        p->level = val;
+        pthread_cond_broadcast(&sim_edge);
+    }
+    pthread_mutex_unlock(&sim_lock);
+    return 1;
+}
+
+int gpiosim_set_input_fn(int pin, gpiosim_input_fn fn, void *user)
+{
+    if (!sim_valid(pin))
+        return -1;
+    pthread_mutex_lock(&sim_lock);
+    sim_pins[pin].fn = fn;
+    sim_pins[pin].user = user;
+    pthread_mutex_unlock(&sim_lock);
+    return 1;
+}
+
+int gpiosim_get_output(int pin)
+{
+    if (!sim_valid(pin))
+        return -1;
+    pthread_mutex_lock(&sim_lock);
+    int val = sim_pins[pin].out;
+    pthread_mutex_unlock(&sim_lock);
+    return val;
+}
+
+uint64_t gpiosim_output_writes(int pin)
+{
+    if (pin < 0 || pin >= GPIOSIM_MAX_PINS)
+        return 0;
+    pthread_mutex_lock(&sim_lock);
+    uint64_t writes = sim_pins[pin].writes;
+    pthread_mutex_unlock(&sim_lock);
+    return writes;
+}
+
+void gpiosim_reset(void)
+{
+    pthread_mutex_lock(&sim_lock);
+    memset(sim_pins, 0, sizeof(sim_pins)); // GPIO_IN, GPIO_PUD_OFF and GPIO_LOW are all 0
+    pthread_mutex_unlock(&sim_lock);
+}
@@ -0,0 +1,81 @@
+/**
+ * @file gpiosim.h
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief In-process GPIO simulator. gpiosim.c implements the gpiodev.h API
+ * without sysfs: link it in place of gpiodev.c to run code that reads limit
+ * switches and writes trigger lines (ScanMotor, IOMotor) without hardware.
+ * @version 0.1
+ * @date 2022-04-09
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#ifndef __GPIOSIM_H
+#define __GPIOSIM_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <stdint.h>
+#include "gpiodev.h"
+
+#ifndef GPIOSIM_MAX_PINS
+#define GPIOSIM_MAX_PINS 64 /// Number of simulated pins, valid pin indices are 0 to GPIOSIM_MAX_PINS - 1
+#endif
+
+/**
+ * @brief Level source of a simulated input, evaluated on every gpioRead.
+ *
+ * @param pin Pin index.
+ * @param user User data given to {@link gpiosim_set_input_fn}.
+ * @return int GPIO_LOW or GPIO_HIGH.
+ */
+typedef int (*gpiosim_input_fn)(int pin, void *user);
+
+/**
+ * @brief Drive a simulated input to a level. A change of level wakes
+ * gpioWaitIRQ and registered IRQ callbacks whose edge matches.
+ *
+ * @param pin Pin index.
+ * @param val GPIO_LOW or GPIO_HIGH.
+ * @return int 1 on success, negative on error.
+ */
+int gpiosim_set_input(int pin, int val);
+
+/**
+ * @brief Let a function give the level of a simulated input, for example a
+ * limit switch that closes at a motor position. Edges are not detected on
+ * such an input.
+ *
+ * @param pin Pin index.
+ * @param fn Level source, NULL to go back to the level set with {@link gpiosim_set_input}.
+ * @param user User data passed to fn.
+ * @return int 1 on success, negative on error.
+ */
+int gpiosim_set_input_fn(int pin, gpiosim_input_fn fn, void *user);
+
+/**
+ * @brief Get the level last written to a simulated output.
+ *
+ * @param pin Pin index.
+ * @return int GPIO_LOW or GPIO_HIGH, negative on error.
+ */
+int gpiosim_get_output(int pin);
+
+/**
+ * @brief Get the number of gpioWrite calls on a simulated pin.
+ *
+ * @param pin Pin index.
+ * @return uint64_t Writes, 0 for an invalid pin.
+ */
+uint64_t gpiosim_output_writes(int pin);
+
+/**
+ * @brief Return every simulated pin to an unconfigured, low input.
+ * Registered IRQs must be unregistered before this call.
+ *
+ */
+void gpiosim_reset(void);
+#ifdef __cplusplus
+}
+#endif
+#endif // __GPIOSIM_H
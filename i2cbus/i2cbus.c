@@ -3,13 +3,18 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <linux/i2c-dev.h>
+#include <linux/i2c.h>
 #include <errno.h>
 #include <stdint.h>
 #include <sys/stat.h>
+#include <sys/file.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
 #include "i2cbus.h"
 
 #ifdef eprintf
@@ -22,146 +27,478 @@
         fflush(stderr);                                                                         \
     }
 
-static int i2clock_initd = 0; /// Indicate that the I2C bus has not been initialized
-
-#ifndef I2CBUS_MAX_NUM
-#define I2CBUS_MAX_NUM 2 /// Maximum 2 /dev/i2cX
+#ifdef __GNUC__
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#else
+#define likely(x) (x)
+#define unlikely(x) (x)
 #endif
+
 /**
- * @brief Set of mutexes for the I2C bus
+ * @brief Cross-process bus lock, in a named shared memory segment.
  *
  */
-pthread_mutex_t i2cbus_locks[I2CBUS_MAX_NUM];
+typedef struct
+{
+    uint32_t magic;       // I2CBUS_XPROC_MAGIC once the mutex is initialized
+    pthread_mutex_t lock; // robust, process-shared
+} i2cbus_xproc_shm;
 
-int i2cbus_open(i2cbus *dev, int id, int addr)
+#define I2CBUS_XPROC_MAGIC 0x69326362 /// "i2cb"
+
+/**
+ * @brief Cross-process lock of a bus as seen by this process. Taken after the
+ * recursive bus lock of the process, by the outermost holder only.
+ *
+ */
+typedef struct
+{
+    i2cbus_xproc_shm *shm;    // NULL without a cross-process lock
+    long timeout_usec;        // wait limit, negative to wait indefinitely
+    int depth;                // nesting of the bus lock in this process
+    i2cbus_xproc_stats stats; // wait statistics of this process
+} i2cbus_xproc;
+
+/**
+ * @brief Lock-free multi-producer, single-consumer queue of requests (D. Vyukov's
+ * intrusive MPSC queue). Producers swap themselves into head, the worker pops
+ * from tail; the stub keeps the queue from ever being empty of nodes.
+ *
+ */
+typedef struct
+{
+    i2cbus_req *head; // last request pushed, swapped by the producers
+    i2cbus_req *tail; // next request to pop, worker only
+    i2cbus_req stub;
+} i2cbus_queue;
+
+/**
+ * @brief I/O worker of a bus, one submission queue per priority class.
+ *
+ */
+typedef struct
+{
+    pthread_t thread;
+    sem_t wake;                          // posted once per queued request
+    i2cbus_queue queue[I2CBUS_PRIO_NUM]; // submission queues, most urgent first
+    int running;                         // accepting requests
+    int users;                           // submitters between the running check and their post
+    int quit;                            // exit once the queues are drained
+} i2cbus_worker;
+
+/**
+ * @brief An I2C bus in use by this process, created when the first device,
+ * worker or cross-process lock on it is opened and freed with the last one.
+ *
+ */
+struct i2cbus_bus
+{
+    int id;                        // X in /dev/i2c-X
+    int refs;                      // open devices, worker, cross-process lock and i2cbus_lock holders; guarded by the registry lock
+    const i2cbus_backend *backend; // transport of every device on the bus
+    pthread_mutex_t lock;          // recursive, serializes transfers within the process
+    int shared_fd;                 // descriptor of the devices opened with i2cbus_open_shared
+    int shared_users;              // devices on shared_fd, guarded by the registry lock
+    int devices;                   // open devices, guarded by the registry lock
+    i2cbus_stats stats;            // guarded by lock
+    i2cbus_xproc xproc;            // guarded by lock
+    i2cbus_worker worker;          // started and stopped under i2cbus_workers_lock
+    int worker_priority;           // SCHED_FIFO priority the worker was started with
+    struct i2cbus_bus *next;
+};
+
+typedef struct i2cbus_bus i2cbus_bus;
+
+static pthread_mutex_t i2cbus_registry_lock = PTHREAD_MUTEX_INITIALIZER; /// Guards the bus list, the reference counts and the default backend
+static i2cbus_bus *i2cbus_registry = NULL;                               /// Buses in use
+static pthread_mutex_t i2cbus_workers_lock = PTHREAD_MUTEX_INITIALIZER;  /// Serializes starting and stopping the workers
+
+static int i2cdev_open(int id, int addr)
 {
-    int ret = 0;
     char fname[256];
-    if (i2clock_initd++ == 0) // only do it when the lock init is zero
+    int fd;
+    // Try to open the file descriptor
+    // step 1: Create file name
+    if (snprintf(fname, 256, "/dev/i2c-%d", id) < 0)
     {
-        pthread_mutexattr_t attr;
-        ret = pthread_mutexattr_init(&attr);
-        if (ret)
+        eprintf("Failed to generate device filename using snprintf. FATAL Error!");
+        return -6;
+    }
+    if ((fd = open(fname, O_RDWR)) < 0)
+    {
+        eprintf("Failed to open %s. Error %d\n", fname, errno);
+        return -errno;
+    }
+    if (ioctl(fd, I2C_SLAVE, addr) < 0)
+    {
+        int err = errno;
+        eprintf("Failed to open I2C slave address 0x%02x on bus %s with error %d, returning...", addr, fname, err);
+        close(fd);
+        return -err;
+    }
+    return fd;
+}
+
+static int i2cdev_write(int fd, const void *buf, int len)
+{
+    return write(fd, buf, len);
+}
+
+static int i2cdev_read(int fd, void *buf, int len)
+{
+    return read(fd, buf, len);
+}
+
+static int i2cdev_rdwr(int fd, struct i2c_msg *msgs, int nmsgs)
+{
+    struct i2c_rdwr_ioctl_data xfer = {.msgs = msgs, .nmsgs = nmsgs};
+    return ioctl(fd, I2C_RDWR, &xfer);
+}
+
+static const i2cbus_backend i2cdev_backend = {
+    .name = "i2c-dev",
+    .open = i2cdev_open,
+    .close = close,
+    .write = i2cdev_write,
+    .read = i2cdev_read,
+    .rdwr = i2cdev_rdwr};
+
+static const i2cbus_backend *i2cbus_backend_current = &i2cdev_backend; /// Backend of the buses created from now on
+
+void i2cbus_set_backend(const i2cbus_backend *backend)
+{
+    pthread_mutex_lock(&i2cbus_registry_lock);
+    i2cbus_backend_current = backend == NULL ? &i2cdev_backend : backend;
+    pthread_mutex_unlock(&i2cbus_registry_lock);
+}
+
+// registry lock held
+static i2cbus_bus *i2cbus_find(int id)
+{
+    for (i2cbus_bus *bus = i2cbus_registry; bus != NULL; bus = bus->next)
+        if (bus->id == id)
+            return bus;
+    return NULL;
+}
+
+// registry lock held: take a reference on bus id, creating it if asked to
+static i2cbus_bus *i2cbus_get_locked(int id, int create)
+{
+    i2cbus_bus *bus = i2cbus_find(id);
+    if (bus == NULL && create)
+    {
+        bus = (i2cbus_bus *)calloc(1, sizeof(i2cbus_bus));
+        if (bus == NULL)
         {
-            eprintf("Could not initialize mutex attribute");
-            ret = -1;
-            goto err;
+            eprintf("Could not allocate bus %d", id);
+            return NULL;
         }
-        ret = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        int ret = pthread_mutex_init(&bus->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
         if (ret)
         {
-            eprintf("Could not initialize mutex attribute");
-            pthread_mutexattr_destroy(&attr);
-            ret = -1;
-            goto err;
+            eprintf("Failed to init the lock of bus %d, error %d", id, ret);
+            free(bus);
+            return NULL;
         }
-        for (int i = 0; i < I2CBUS_MAX_NUM; i++)
+        bus->id = id;
+        bus->backend = i2cbus_backend_current;
+        bus->shared_fd = -1;
+        bus->next = i2cbus_registry;
+        i2cbus_registry = bus;
+    }
+    if (bus != NULL)
+        bus->refs++;
+    return bus;
+}
+
+static i2cbus_bus *i2cbus_get(int id, int create)
+{
+    pthread_mutex_lock(&i2cbus_registry_lock);
+    i2cbus_bus *bus = i2cbus_get_locked(id, create);
+    pthread_mutex_unlock(&i2cbus_registry_lock);
+    return bus;
+}
+
+// drop a reference, the last one frees the bus
+static void i2cbus_put(i2cbus_bus *bus)
+{
+    pthread_mutex_lock(&i2cbus_registry_lock);
+    if (--bus->refs > 0)
+    {
+        pthread_mutex_unlock(&i2cbus_registry_lock);
+        return;
+    }
+    for (i2cbus_bus **p = &i2cbus_registry; *p != NULL; p = &(*p)->next)
+    {
+        if (*p == bus)
         {
-            ret = pthread_mutex_init(&(i2cbus_locks[i]), &attr);
-            if (ret)
-            {
-                eprintf("Failed to init mutex %d, ", i);
-                perror("mutex init");
-                pthread_mutexattr_destroy(&attr);
-                ret = -2;
-                goto err;
-            }
+            *p = bus->next;
+            break;
         }
-        pthread_mutexattr_destroy(&attr);
     }
+    pthread_mutex_unlock(&i2cbus_registry_lock);
+    int ret = pthread_mutex_destroy(&bus->lock);
+    if (ret)
+        eprintf("Failed to destroy the lock of bus %d, error %d", bus->id, ret);
+    free(bus);
+}
+
+static int i2cbus_open_mode(i2cbus *dev, int id, int addr, int shared)
+{
     // check 1: memory
     if (dev == NULL)
     {
         eprintf("Error: Device descriptor is NULL");
-        ret = -3;
-        goto err;
+        return -1;
     }
-    // check 2: id > I2CBUS_MAX_NUM - 1
-    if (!(id < I2CBUS_MAX_NUM))
+    // check 2: id valid range
+    if (id < 0)
     {
-        eprintf("System supports up to %d ID, you provided %d.", I2CBUS_MAX_NUM - 1, id);
-        ret = -4;
-        goto err;
+        eprintf("Invalid bus index %d", id);
+        return -1;
     }
     // check 3: addr valid range
     if (addr < 8)
     {
         fprintf(stderr, "%s: Address 0x%02x is invalid\n", __func__, addr);
-        ret = -5;
-        goto err;
+        return -1;
     }
-
-    // Try to open the file descriptor
-    // step 1: Create file name
-    if (snprintf(fname, 256, "/dev/i2c-%d", id) < 0)
+    pthread_mutex_lock(&i2cbus_registry_lock);
+    i2cbus_bus *bus = i2cbus_get_locked(id, 1);
+    if (bus == NULL)
     {
-        eprintf("Failed to generate device filename using snprintf. FATAL Error!");
-        ret = -6;
-        goto err;
+        pthread_mutex_unlock(&i2cbus_registry_lock);
+        return -1;
     }
-    if ((dev->fd = open(fname, O_RDWR)) < 0)
+    int fd;
+    if (shared)
     {
-        eprintf("Failed to open %s. Error %d\n", fname, errno);
-        ret = -errno;
-        goto err;
+        // one descriptor for the bus, every transfer names its slave (I2C_RDWR)
+        if (bus->shared_users == 0)
+            bus->shared_fd = bus->backend->open(id, addr);
+        fd = bus->shared_fd;
+        if (fd >= 0)
+            bus->shared_users++;
     }
-    if (ioctl(dev->fd, I2C_SLAVE, addr) < 0)
+    else
+        fd = bus->backend->open(id, addr);
+    if (fd >= 0)
+        bus->devices++;
+    pthread_mutex_unlock(&i2cbus_registry_lock);
+    if (fd < 0)
     {
-        eprintf("Failed to open I2C slave address 0x%02x on bus %s with error %d, returning...", addr, fname, errno);
-        close(dev->fd);
-        ret = -errno;
-        goto err;
+        i2cbus_put(bus);
+        return -1;
     }
     // if we are here, then everything was successful
-    dev->id = id;                    // assign device id
-    dev->lock = &(i2cbus_locks[id]); // assign lock
+    dev->fd = fd;
+    dev->id = id;             // assign device id
+    dev->addr = addr;         // assign slave address
+    dev->lock = &(bus->lock); // assign lock
+    dev->backend = bus->backend;
+    dev->shared = shared;
+    dev->bus = bus;
     return dev->fd;
-err:
-    i2clock_initd--;
-    return -1;
+}
+
+int i2cbus_open(i2cbus *dev, int id, int addr)
+{
+    return i2cbus_open_mode(dev, id, addr, 0);
+}
+
+int i2cbus_open_shared(i2cbus *dev, int id, int addr)
+{
+    return i2cbus_open_mode(dev, id, addr, 1);
 }
 
 int i2cbus_close(i2cbus *dev)
 {
-    if (--i2clock_initd == 0) // only do it when the lock init is zero
+    if (dev == NULL)
+    {
+        eprintf("Invalid device descriptor");
+        return -3;
+    }
+    i2cbus_bus *bus = dev->bus;
+    if (bus == NULL)
+    {
+        eprintf("Device is not open");
+        return -1;
+    }
+    int ret = 0;
+    pthread_mutex_lock(&i2cbus_registry_lock);
+    if (dev->shared)
+    {
+        if (--bus->shared_users == 0)
+        {
+            ret = bus->backend->close(bus->shared_fd);
+            bus->shared_fd = -1;
+        }
+    }
+    else if (dev->fd > 0)
+        ret = dev->backend->close(dev->fd);
+    bus->devices--;
+    pthread_mutex_unlock(&i2cbus_registry_lock);
+    dev->bus = NULL;
+    dev->fd = -1;
+    i2cbus_put(bus);
+    return ret;
+}
+
+static inline uint64_t i2cbus_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LLU + ts.tv_nsec;
+}
+
+static int i2cbus_xproc_acquire(i2cbus_xproc *x)
+{
+    uint64_t t0 = i2cbus_now_ns();
+    int ret = pthread_mutex_trylock(&x->shm->lock);
+    if (ret == EBUSY)
+    {
+        x->stats.contended++;
+        if (x->timeout_usec < 0)
+            ret = pthread_mutex_lock(&x->shm->lock);
+        else
+        {
+            struct timespec ts; // timedlock takes CLOCK_REALTIME
+            clock_gettime(CLOCK_REALTIME, &ts);
+            uint64_t ns = ts.tv_nsec + (x->timeout_usec % 1000000) * 1000;
+            ts.tv_sec += x->timeout_usec / 1000000 + ns / 1000000000;
+            ts.tv_nsec = ns % 1000000000;
+            ret = pthread_mutex_timedlock(&x->shm->lock, &ts);
+        }
+    }
+    if (ret == EOWNERDEAD)
+    {
+        // the owner died holding the bus, maybe halfway through a transaction: the next one starts clean
+        pthread_mutex_consistent(&x->shm->lock);
+        x->stats.owner_deaths++;
+        ret = 0;
+    }
+    if (ret == 0)
+    {
+        uint64_t wait = i2cbus_now_ns() - t0;
+        x->stats.acquisitions++;
+        x->stats.wait_ns += wait;
+        if (wait > x->stats.wait_max_ns)
+            x->stats.wait_max_ns = wait;
+    }
+    else if (ret == ETIMEDOUT)
+        x->stats.timeouts++;
+    return ret;
+}
+
+// lock the bus, and its cross-process lock if it has one; returns 0 or an error number
+static int i2cbus_bus_lock(i2cbus_bus *bus, int try_only)
+{
+    int ret = pthread_mutex_trylock(&bus->lock);
+    if (ret == EBUSY && !try_only)
     {
-        for (int i = 0; i < I2CBUS_MAX_NUM; i++)
+        uint64_t t0 = i2cbus_now_ns();
+        ret = pthread_mutex_lock(&bus->lock);
+        if (ret == 0)
         {
-            int ret = pthread_mutex_destroy(&(i2cbus_locks[i]));
-            if (ret != 0)
+            bus->stats.contended++;
+            bus->stats.lock_wait_ns += i2cbus_now_ns() - t0;
+        }
+    }
+    if (ret)
+        return ret;
+    i2cbus_xproc *x = &bus->xproc;
+    if (x->shm != NULL && x->depth == 0)
+    {
+        if (try_only)
+        {
+            ret = pthread_mutex_trylock(&x->shm->lock);
+            if (ret == EOWNERDEAD)
             {
-                eprintf("Failed to destroy mutex %d, ", i);
-                perror("mutex destroy");
-                return -1;
+                pthread_mutex_consistent(&x->shm->lock);
+                x->stats.owner_deaths++;
+                ret = 0;
             }
+            if (ret == 0)
+                x->stats.acquisitions++;
+        }
+        else
+            ret = i2cbus_xproc_acquire(x);
+        if (ret)
+        {
+            pthread_mutex_unlock(&bus->lock);
+            return ret;
         }
     }
-    if (dev != NULL)
+    x->depth++;
+    return 0;
+}
+
+// unlock the bus, EPERM if the calling thread does not hold it
+static int i2cbus_bus_unlock(i2cbus_bus *bus)
+{
+    i2cbus_xproc *x = &bus->xproc;
+    // the recursive lock only nests for its owner: busy means another thread holds it,
+    // no earlier hold means nobody did; either way depth and the cross-process lock stay
+    int ret = pthread_mutex_trylock(&bus->lock);
+    if (ret)
+        return ret == EBUSY ? EPERM : ret;
+    int held = x->depth > 0;
+    pthread_mutex_unlock(&bus->lock);
+    if (!held)
+        return EPERM;
+    if (--x->depth == 0 && x->shm != NULL)
+        pthread_mutex_unlock(&x->shm->lock);
+    return pthread_mutex_unlock(&bus->lock);
+}
+
+// a shared descriptor is not bound to the slave, address each transfer
+// bus lock held for these, they count the transfers of the bus
+static int i2cbus_dev_rdwr(i2cbus *dev, struct i2c_msg *msgs, int nmsgs)
+{
+    int ret = dev->backend->rdwr(dev->fd, msgs, nmsgs);
+    dev->bus->stats.transfers++;
+    if (ret != nmsgs)
+        dev->bus->stats.errors++;
+    return ret;
+}
+
+static int i2cbus_dev_write(i2cbus *dev, const void *buf, int len)
+{
+    if (dev->shared)
     {
-        if (dev->fd > 0)
-            return close(dev->fd);
+        struct i2c_msg msg = {.addr = dev->addr, .flags = 0, .len = len, .buf = (uint8_t *)buf};
+        return i2cbus_dev_rdwr(dev, &msg, 1) == 1 ? len : -1;
     }
-    else
+    int ret = dev->backend->write(dev->fd, buf, len);
+    dev->bus->stats.transfers++;
+    if (ret != len)
+        dev->bus->stats.errors++;
+    return ret;
+}
+
+static int i2cbus_dev_read(i2cbus *dev, void *buf, int len)
+{
+    if (dev->shared)
     {
-        eprintf("Invalid device descriptor");
-        return -3;
+        struct i2c_msg msg = {.addr = dev->addr, .flags = I2C_M_RD, .len = len, .buf = (uint8_t *)buf};
+        return i2cbus_dev_rdwr(dev, &msg, 1) == 1 ? len : -1;
     }
-    // will never reach this point
-    return -1;
+    int ret = dev->backend->read(dev->fd, buf, len);
+    dev->bus->stats.transfers++;
+    if (ret != len)
+        dev->bus->stats.errors++;
+    return ret;
 }
 
-#ifdef __GNUC__
-#define likely(x) __builtin_expect(!!(x), 1)
-#define unlikely(x) __builtin_expect(!!(x), 0)
-#else
-#define likely(x) (x)
-#define unlikely(x) (x)
-#endif
-
 int i2cbus_write(i2cbus *dev, void *buf, int len)
 {
     // usual checks
-    if (unlikely(dev == NULL || dev->fd < 0))
+    if (unlikely(dev == NULL || dev->fd < 0 || dev->bus == NULL))
     {
         eprintf("Invalid device pointer %p or file descriptor %d", dev, dev->fd);
         return -1;
@@ -171,27 +508,29 @@ int i2cbus_write(i2cbus *dev, void *buf, int len)
         eprintf("Invalid write buffer pointer NULL");
         return -1;
     }
-    int status = pthread_mutex_lock(dev->lock);
+    int status = i2cbus_bus_lock(dev->bus, 0);
     if (status)
     {
-        eprintf("Mutex lock returned %d, error", status);
+        if (status != ETIMEDOUT) // the bus is held by another process
+            eprintf("Mutex lock returned %d, error", status);
+        errno = status;
         return -1;
     }
-    status = write(dev->fd, buf, len);
+    status = i2cbus_dev_write(dev, buf, len);
     if (status != len)
     {
 #ifdef I2C_DEBUG
         eprintf("Failed to write %d bytes, wrote %d bytes, errno %d", len, status, errno);
 #endif
     }
-    pthread_mutex_unlock(dev->lock);
+    i2cbus_bus_unlock(dev->bus);
     return status;
 }
 
 int i2cbus_read(i2cbus *dev, void *buf, int len)
 {
     // usual checks
-    if (unlikely(dev == NULL || dev->fd < 0))
+    if (unlikely(dev == NULL || dev->fd < 0 || dev->bus == NULL))
     {
         eprintf("Invalid device pointer %p or file descriptor %d", dev, dev->fd);
         return -1;
@@ -201,20 +540,22 @@ int i2cbus_read(i2cbus *dev, void *buf, int len)
         eprintf("Invalid write buffer pointer NULL");
         return -1;
     }
-    int status = pthread_mutex_lock(dev->lock);
+    int status = i2cbus_bus_lock(dev->bus, 0);
     if (status)
     {
-        eprintf("Mutex lock returned %d, error", status);
+        if (status != ETIMEDOUT) // the bus is held by another process
+            eprintf("Mutex lock returned %d, error", status);
+        errno = status;
         return -1;
     }
-    status = read(dev->fd, buf, len);
+    status = i2cbus_dev_read(dev, buf, len);
     if (status != len)
     {
 #ifdef I2C_DEBUG
         eprintf("Failed to read %d bytes, read %d bytes, errno %d", len, status, errno);
 #endif
     }
-    pthread_mutex_unlock(dev->lock);
+    i2cbus_bus_unlock(dev->bus);
     return status;
 }
 
@@ -224,7 +565,7 @@ int i2cbus_xfer(i2cbus *dev,
                 unsigned long timeout_usec)
 {
     // usual checks
-    if (unlikely(dev == NULL || dev->fd < 0))
+    if (unlikely(dev == NULL || dev->fd < 0 || dev->bus == NULL))
     {
         eprintf("Invalid device pointer %p or file descriptor %d", dev, dev->fd);
         return -1;
@@ -239,10 +580,12 @@ int i2cbus_xfer(i2cbus *dev,
         eprintf("Invalid read buffer pointer NULL");
         return -1;
     }
-    int status = pthread_mutex_lock(dev->lock);
+    int status = i2cbus_bus_lock(dev->bus, 0);
     if (status)
     {
-        eprintf("Mutex lock returned %d, error", status);
+        if (status != ETIMEDOUT) // the bus is held by another process
+            eprintf("Mutex lock returned %d, error", status);
+        errno = status;
         return -1;
     }
 #ifdef I2C_DEBUG
@@ -253,7 +596,7 @@ int i2cbus_xfer(i2cbus *dev,
     }
     eprintf("\n");
 #endif
-    status = write(dev->fd, outbuf, outlen);
+    status = i2cbus_dev_write(dev, outbuf, outlen);
     if (status != outlen)
     {
 #ifdef I2C_DEBUG
@@ -265,7 +608,7 @@ int i2cbus_xfer(i2cbus *dev,
     {
         usleep(timeout_usec);
     }
-    status = read(dev->fd, inbuf, inlen);
+    status = i2cbus_dev_read(dev, inbuf, inlen);
     if (status != inlen)
     {
 #ifdef I2C_DEBUG
@@ -282,45 +625,566 @@ int i2cbus_xfer(i2cbus *dev,
     eprintf("\n");
 #endif
 ret:
-    pthread_mutex_unlock(dev->lock);
+    i2cbus_bus_unlock(dev->bus);
     return status;
 }
 
+int i2cbus_write_read(i2cbus *dev,
+                      const void *outbuf, int outlen,
+                      void *inbuf, int inlen)
+{
+    // usual checks
+    if (unlikely(dev == NULL || dev->fd < 0 || dev->bus == NULL))
+    {
+        eprintf("Invalid device pointer %p or file descriptor %d", dev, dev->fd);
+        return -1;
+    }
+    if (unlikely(outbuf == NULL))
+    {
+        eprintf("Invalid write buffer pointer NULL");
+        return -1;
+    }
+    if (unlikely(inbuf == NULL))
+    {
+        eprintf("Invalid read buffer pointer NULL");
+        return -1;
+    }
+    struct i2c_msg msgs[2] = {
+        {.addr = dev->addr, .flags = 0, .len = outlen, .buf = (uint8_t *)outbuf},
+        {.addr = dev->addr, .flags = I2C_M_RD, .len = inlen, .buf = (uint8_t *)inbuf}};
+    int status = i2cbus_bus_lock(dev->bus, 0);
+    if (status)
+    {
+        if (status != ETIMEDOUT) // the bus is held by another process
+            eprintf("Mutex lock returned %d, error", status);
+        errno = status;
+        return -1;
+    }
+    status = i2cbus_dev_rdwr(dev, msgs, 2);
+    if (status != 2)
+    {
+#ifdef I2C_DEBUG
+        eprintf("Failed to write %d bytes and read %d bytes, errno %d", outlen, inlen, errno);
+#endif
+        status = -1;
+    }
+    else
+    {
+        status = inlen;
+    }
+    i2cbus_bus_unlock(dev->bus);
+    return status;
+}
+
+int i2cbus_transfer_batch(i2cbus *dev, i2cbus_msg *msgs, int n)
+{
+    // usual checks
+    if (unlikely(dev == NULL || dev->fd < 0 || dev->bus == NULL))
+    {
+        eprintf("Invalid device pointer %p or file descriptor %d", dev, dev->fd);
+        return -1;
+    }
+    if (unlikely(msgs == NULL || n < 0))
+    {
+        eprintf("Invalid message array %p of length %d", msgs, n);
+        return -1;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        if (unlikely(msgs[i].buf == NULL || msgs[i].len < 0 || msgs[i].len > 0xffff))
+        {
+            eprintf("Invalid buffer %p of length %d in message %d", msgs[i].buf, msgs[i].len, i);
+            return -1;
+        }
+    }
+    int status = i2cbus_bus_lock(dev->bus, 0);
+    if (status)
+    {
+        if (status != ETIMEDOUT) // the bus is held by another process
+            eprintf("Mutex lock returned %d, error", status);
+        errno = status;
+        return -1;
+    }
+    int done = 0;
+    while (done < n)
+    {
+        struct i2c_msg xfer[I2CBUS_BATCH_MAX];
+        int count = n - done < I2CBUS_BATCH_MAX ? n - done : I2CBUS_BATCH_MAX;
+        for (int i = 0; i < count; i++)
+        {
+            const i2cbus_msg *m = &msgs[done + i];
+            xfer[i].addr = m->addr ? m->addr : dev->addr;
+            xfer[i].flags = m->read ? I2C_M_RD : 0;
+            xfer[i].len = m->len;
+            xfer[i].buf = (uint8_t *)m->buf;
+        }
+        status = i2cbus_dev_rdwr(dev, xfer, count);
+        if (status != count)
+        {
+            int err = status < 0 && errno ? errno : EIO;
+#ifdef I2C_DEBUG
+            eprintf("Failed to transfer messages %d-%d of %d, errno %d", done, done + count - 1, n, err);
+#endif
+            for (int i = done; i < n; i++)
+                msgs[i].status = i < done + count ? -err : -ECANCELED;
+            break;
+        }
+        for (int i = 0; i < count; i++)
+            msgs[done + i].status = msgs[done + i].len;
+        done += count;
+    }
+    i2cbus_bus_unlock(dev->bus);
+    return done;
+}
+
+enum
+{
+    I2CBUS_REQ_QUEUED = 1, // waiting for, or being run by, the worker
+    I2CBUS_REQ_INLINE,     // being run by the submitting thread
+    I2CBUS_REQ_DONE
+};
+
+static void i2cbus_queue_init(i2cbus_queue *q)
+{
+    q->stub.next = NULL;
+    q->head = q->tail = &q->stub;
+}
+
+static void i2cbus_queue_push(i2cbus_queue *q, i2cbus_req *req)
+{
+    __atomic_store_n(&req->next, NULL, __ATOMIC_RELAXED);
+    i2cbus_req *prev = __atomic_exchange_n(&q->head, req, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, req, __ATOMIC_RELEASE); // until here the request is invisible to the worker
+}
+
+static i2cbus_req *i2cbus_queue_pop(i2cbus_queue *q)
+{
+    i2cbus_req *tail = q->tail;
+    i2cbus_req *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (tail == &q->stub)
+    {
+        if (next == NULL)
+            return NULL;
+        q->tail = tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+    if (next != NULL)
+    {
+        q->tail = next;
+        return tail;
+    }
+    // tail is the last request: put the stub behind it before handing it out
+    if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+        return NULL; // a push is half done, its post wakes the worker again
+    i2cbus_queue_push(q, &q->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next != NULL)
+    {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static void i2cbus_req_run(i2cbus_req *req)
+{
+    int queued = req->state == I2CBUS_REQ_QUEUED;
+    req->result = i2cbus_transfer_batch(req->dev, req->msgs, req->n);
+    if (req->cb != NULL)
+        req->cb(req, req->user);
+    if (queued)
+        sem_post(&req->done);
+    // last access: the owner may reuse the request once it reads DONE
+    __atomic_store_n(&req->state, I2CBUS_REQ_DONE, __ATOMIC_RELEASE);
+}
+
+static void *i2cbus_worker_fn(void *arg)
+{
+    i2cbus_worker *w = (i2cbus_worker *)arg;
+    for (;;)
+    {
+        int quit = __atomic_load_n(&w->quit, __ATOMIC_ACQUIRE);
+        i2cbus_req *req = NULL;
+        for (int p = 0; p < I2CBUS_PRIO_NUM && req == NULL; p++)
+            req = i2cbus_queue_pop(&w->queue[p]);
+        if (req != NULL)
+        {
+            i2cbus_req_run(req); // then look at the most urgent class again
+            continue;
+        }
+        if (quit) // no submitter is left when quit is set, the queues are drained
+            break;
+        while (sem_wait(&w->wake) && errno == EINTR)
+            ;
+    }
+    return NULL;
+}
+
+int i2cbus_worker_start(int id, int priority)
+{
+    if (unlikely(id < 0))
+    {
+        eprintf("Invalid bus index %d", id);
+        return -100;
+    }
+    if (unlikely(priority < 0 || priority > 99))
+    {
+        eprintf("Invalid worker priority %d", priority);
+        return -EINVAL;
+    }
+    i2cbus_bus *bus = i2cbus_get(id, 1); // held while the worker runs
+    if (bus == NULL)
+        return -ENOMEM;
+    i2cbus_worker *w = &bus->worker;
+    pthread_mutex_lock(&i2cbus_workers_lock);
+    if (w->running)
+    {
+        pthread_mutex_unlock(&i2cbus_workers_lock);
+        i2cbus_put(bus);
+        return 0;
+    }
+    for (int p = 0; p < I2CBUS_PRIO_NUM; p++)
+        i2cbus_queue_init(&w->queue[p]);
+    sem_init(&w->wake, 0, 0);
+    w->quit = 0;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (priority > 0)
+    {
+        struct sched_param param = {.sched_priority = priority};
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&attr, &param);
+    }
+    int ret = pthread_create(&w->thread, &attr, i2cbus_worker_fn, w);
+    pthread_attr_destroy(&attr);
+    if (ret)
+    {
+        eprintf("Could not start the worker of bus %d, error %d", id, ret);
+        sem_destroy(&w->wake);
+        pthread_mutex_unlock(&i2cbus_workers_lock);
+        i2cbus_put(bus);
+        return -ret;
+    }
+    bus->worker_priority = priority;
+    __atomic_store_n(&w->running, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&i2cbus_workers_lock);
+    return 1;
+}
+
+int i2cbus_worker_stop(int id)
+{
+    i2cbus_bus *bus = i2cbus_get(id, 0);
+    if (bus == NULL)
+        return 0;
+    i2cbus_worker *w = &bus->worker;
+    pthread_mutex_lock(&i2cbus_workers_lock);
+    if (!w->running)
+    {
+        pthread_mutex_unlock(&i2cbus_workers_lock);
+        i2cbus_put(bus);
+        return 0;
+    }
+    // new submitters run inline from here on, wait out the ones that saw the worker running
+    __atomic_store_n(&w->running, 0, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&w->users, __ATOMIC_SEQ_CST))
+        sched_yield();
+    __atomic_store_n(&w->quit, 1, __ATOMIC_RELEASE);
+    sem_post(&w->wake);
+    pthread_join(w->thread, NULL);
+    sem_destroy(&w->wake);
+    pthread_mutex_unlock(&i2cbus_workers_lock);
+    i2cbus_put(bus);
+    i2cbus_put(bus); // the reference of the worker
+    return 1;
+}
+
+int i2cbus_worker_running(int id)
+{
+    i2cbus_bus *bus = i2cbus_get(id, 0);
+    if (bus == NULL)
+        return 0;
+    int running = __atomic_load_n(&bus->worker.running, __ATOMIC_ACQUIRE);
+    i2cbus_put(bus);
+    return running;
+}
+
+int i2cbus_submit(i2cbus_req *req)
+{
+    if (unlikely(req == NULL || req->dev == NULL || req->prio < 0 || req->prio >= I2CBUS_PRIO_NUM))
+    {
+        eprintf("Invalid request %p", req);
+        return -1;
+    }
+    req->result = 0;
+    if (likely(req->dev->bus != NULL))
+    {
+        i2cbus_worker *w = &req->dev->bus->worker;
+        __atomic_add_fetch(&w->users, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&w->running, __ATOMIC_SEQ_CST))
+        {
+            sem_init(&req->done, 0, 0);
+            __atomic_store_n(&req->state, I2CBUS_REQ_QUEUED, __ATOMIC_RELAXED);
+            i2cbus_queue_push(&w->queue[req->prio], req);
+            sem_post(&w->wake);
+            __atomic_sub_fetch(&w->users, 1, __ATOMIC_SEQ_CST);
+            return 1;
+        }
+        __atomic_sub_fetch(&w->users, 1, __ATOMIC_SEQ_CST);
+    }
+    // no worker on the bus: run in the calling thread
+    req->state = I2CBUS_REQ_INLINE;
+    i2cbus_req_run(req);
+    return 0;
+}
+
+int i2cbus_req_done(const i2cbus_req *req)
+{
+    return __atomic_load_n(&req->state, __ATOMIC_ACQUIRE) == I2CBUS_REQ_DONE;
+}
+
+int i2cbus_req_wait(i2cbus_req *req, long timeout_usec)
+{
+    if (i2cbus_req_done(req))
+        return req->result;
+    int ret;
+    if (timeout_usec < 0)
+    {
+        while ((ret = sem_wait(&req->done)) && errno == EINTR)
+            ;
+    }
+    else
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        uint64_t ns = ts.tv_nsec + (timeout_usec % 1000000) * 1000;
+        ts.tv_sec += timeout_usec / 1000000 + ns / 1000000000;
+        ts.tv_nsec = ns % 1000000000;
+        while ((ret = sem_timedwait(&req->done, &ts)) && errno == EINTR)
+            ;
+    }
+    if (ret)
+        return -ETIMEDOUT;
+    while (!i2cbus_req_done(req)) // the worker marks the request done right after the post
+        sched_yield();
+    return req->result;
+}
+
 int i2cbus_lock(unsigned int bus)
 {
-    if (unlikely(bus >= I2CBUS_MAX_NUM))
+    i2cbus_bus *b = i2cbus_get(bus, 0); // held until i2cbus_unlock
+    if (unlikely(b == NULL))
     {
-        eprintf("Bus index %d not supported, maximum is %d", bus, I2CBUS_MAX_NUM - 1);
+        eprintf("No device open on bus %u", bus);
         return -100;
     }
-    int ret = pthread_mutex_lock(&(i2cbus_locks[bus]));
+    int ret = i2cbus_bus_lock(b, 0);
     if (ret)
+    {
+        i2cbus_put(b);
         return -ret;
+    }
     return 1;
 }
 
 int i2cbus_trylock(unsigned int bus)
 {
-    if (unlikely(bus >= I2CBUS_MAX_NUM))
+    i2cbus_bus *b = i2cbus_get(bus, 0); // held until i2cbus_unlock
+    if (unlikely(b == NULL))
     {
-        eprintf("Bus index %d not supported, maximum is %d", bus, I2CBUS_MAX_NUM - 1);
+        eprintf("No device open on bus %u", bus);
         return -100;
     }
-    int ret = pthread_mutex_trylock(&(i2cbus_locks[bus]));
+    int ret = i2cbus_bus_lock(b, 1);
     if (ret)
+    {
+        i2cbus_put(b);
         return -ret;
+    }
     return 1;
 }
 
 int i2cbus_unlock(unsigned int bus)
 {
-    if (unlikely(bus >= I2CBUS_MAX_NUM))
+    i2cbus_bus *b = i2cbus_get(bus, 0);
+    if (unlikely(b == NULL))
     {
-        eprintf("Bus index %d not supported, maximum is %d", bus, I2CBUS_MAX_NUM - 1);
+        eprintf("No device open on bus %u", bus);
         return -100;
     }
-    int ret = pthread_mutex_unlock(&(i2cbus_locks[bus]));
+    int ret = i2cbus_bus_unlock(b);
+    i2cbus_put(b);
     if (ret)
         return -ret;
+    i2cbus_put(b); // the reference of i2cbus_lock
     return 1;
-}
\ No newline at end of file
+}
+
+int i2cbus_xproc_lock_open(int id, const char *name, long timeout_usec)
+{
+    if (unlikely(id < 0))
+    {
+        eprintf("Invalid bus index %d", id);
+        return -100;
+    }
+    char fname[64];
+    if (name == NULL)
+        snprintf(fname, sizeof(fname), "/i2cbus-%d", id);
+    else
+        snprintf(fname, sizeof(fname), "%s", name);
+    // owner and group only: a process of any user could otherwise hold or corrupt the bus lock
+    int fd = shm_open(fname, O_RDWR | O_CREAT, 0660);
+    if (fd < 0)
+    {
+        int err = errno;
+        eprintf("Could not open shared memory %s, error %d", fname, err);
+        return -err;
+    }
+    // the segment is sized and the mutex initialized under a file lock, which the kernel drops if
+    // its holder dies: a segment left zeroed by a creator that died is initialized by the next opener
+    int err = 0;
+    struct stat st;
+    while (flock(fd, LOCK_EX) && errno == EINTR)
+        ;
+    if (fstat(fd, &st) || (st.st_size < (off_t)sizeof(i2cbus_xproc_shm) && ftruncate(fd, sizeof(i2cbus_xproc_shm))))
+    {
+        err = errno;
+        eprintf("Could not size shared memory %s, error %d", fname, err);
+    }
+    i2cbus_xproc_shm *shm = MAP_FAILED;
+    if (!err)
+    {
+        shm = (i2cbus_xproc_shm *)mmap(NULL, sizeof(i2cbus_xproc_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (shm == MAP_FAILED)
+        {
+            err = errno;
+            eprintf("Could not map shared memory %s, error %d", fname, err);
+        }
+    }
+    if (!err && shm->magic == 0)
+    {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&shm->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+        __atomic_store_n(&shm->magic, I2CBUS_XPROC_MAGIC, __ATOMIC_RELEASE);
+    }
+    else if (!err && shm->magic != I2CBUS_XPROC_MAGIC)
+    {
+        eprintf("Shared memory %s does not hold an i2cbus lock", fname);
+        munmap(shm, sizeof(i2cbus_xproc_shm));
+        err = EINVAL;
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+    if (err)
+        return -err;
+    i2cbus_bus *bus = i2cbus_get(id, 1); // held while the lock is open
+    if (bus == NULL)
+    {
+        munmap(shm, sizeof(i2cbus_xproc_shm));
+        return -ENOMEM;
+    }
+    // install under the bus lock, so that no holder of the bus misses the new lock on its way out
+    int ret = 0;
+    pthread_mutex_lock(&bus->lock);
+    i2cbus_xproc *x = &bus->xproc;
+    if (x->shm != NULL || x->depth > 0)
+    {
+        eprintf("Bus %d already has a cross-process lock or is held by this thread", id);
+        ret = -EBUSY;
+    }
+    else
+    {
+        x->shm = shm;
+        x->timeout_usec = timeout_usec;
+        memset(&x->stats, 0, sizeof(x->stats));
+        ret = 1;
+    }
+    pthread_mutex_unlock(&bus->lock);
+    if (ret < 0)
+    {
+        munmap(shm, sizeof(i2cbus_xproc_shm));
+        i2cbus_put(bus);
+    }
+    return ret;
+}
+
+int i2cbus_xproc_lock_close(int id)
+{
+    i2cbus_bus *bus = i2cbus_get(id, 0);
+    if (bus == NULL)
+        return 0;
+    int ret = 0;
+    pthread_mutex_lock(&bus->lock);
+    i2cbus_xproc *x = &bus->xproc;
+    if (x->depth > 0)
+        ret = -EBUSY; // held by this thread, the lock is released on the way out
+    else if (x->shm != NULL)
+    {
+        munmap(x->shm, sizeof(i2cbus_xproc_shm));
+        x->shm = NULL;
+        ret = 1;
+    }
+    pthread_mutex_unlock(&bus->lock);
+    i2cbus_put(bus);
+    if (ret == 1)
+        i2cbus_put(bus); // the reference of the lock
+    return ret;
+}
+
+int i2cbus_xproc_lock_stats(int id, i2cbus_xproc_stats *stats)
+{
+    if (unlikely(stats == NULL))
+    {
+        eprintf("Invalid stats pointer NULL");
+        return -1;
+    }
+    memset(stats, 0, sizeof(*stats));
+    i2cbus_bus *bus = i2cbus_get(id, 0);
+    if (bus == NULL)
+        return 0;
+    pthread_mutex_lock(&bus->lock);
+    *stats = bus->xproc.stats;
+    int ret = bus->xproc.shm != NULL;
+    pthread_mutex_unlock(&bus->lock);
+    i2cbus_put(bus);
+    return ret;
+}
+
+int i2cbus_get_stats(int id, i2cbus_stats *stats)
+{
+    if (unlikely(stats == NULL))
+    {
+        eprintf("Invalid stats pointer NULL");
+        return -1;
+    }
+    memset(stats, 0, sizeof(*stats));
+    i2cbus_bus *bus = i2cbus_get(id, 0);
+    if (bus == NULL)
+        return 0;
+    pthread_mutex_lock(&bus->lock);
+    *stats = bus->stats;
+    pthread_mutex_unlock(&bus->lock);
+    pthread_mutex_lock(&i2cbus_registry_lock);
+    stats->devices = bus->devices;
+    pthread_mutex_unlock(&i2cbus_registry_lock);
+    stats->worker = __atomic_load_n(&bus->worker.running, __ATOMIC_ACQUIRE);
+    stats->worker_priority = bus->worker_priority;
+    stats->backend = bus->backend->name;
+    i2cbus_put(bus);
+    return 1;
+}
+
+int i2cbus_list(int *ids, int max)
+{
+    int n = 0;
+    pthread_mutex_lock(&i2cbus_registry_lock);
+    for (i2cbus_bus *bus = i2cbus_registry; bus != NULL; bus = bus->next, n++)
+        if (ids != NULL && n < max)
+            ids[n] = bus->id;
+    pthread_mutex_unlock(&i2cbus_registry_lock);
+    return n;
+}
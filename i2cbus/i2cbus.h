@@ -13,7 +13,104 @@
 #ifdef __cplusplus 
 extern "C" {
 #endif
+#include <stdint.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <linux/i2c.h>
+
+/**
+ * @brief Transport used by the i2cbus functions to reach the devices. The
+ * default backend talks to /dev/i2c-X, other backends (e.g. the PCA9685
+ * simulator in i2csim.h) can be installed with {@link i2cbus_set_backend}.
+ * All calls except open are made with the bus lock held.
+ *
+ */
+typedef struct i2cbus_backend
+{
+    const char *name;                                                  ///< Backend name, for diagnostics
+    int (*open)(int id, int addr);                                     ///< Open a handle to a slave on bus id, returns a positive handle or negative on error
+    int (*close)(int fd);                                              ///< Close a handle returned by open
+    int (*write)(int fd, const void *buf, int len);                    ///< Write len bytes in one transfer, returns bytes written
+    int (*read)(int fd, void *buf, int len);                           ///< Read len bytes in one transfer, returns bytes read
+    int (*rdwr)(int fd, struct i2c_msg *msgs, int nmsgs);              ///< Combined transfer with repeated starts, returns messages transferred
+} i2cbus_backend;
+
+/**
+ * @brief Maximum number of messages the kernel takes in one I2C_RDWR call
+ * (I2C_RDWR_IOCTL_MAX_MSGS). Longer batches are split into transfers of this size.
+ *
+ */
+#define I2CBUS_BATCH_MAX 42
+
+/**
+ * @brief One message of a batch sent with {@link i2cbus_transfer_batch}.
+ *
+ */
+typedef struct
+{
+    int addr;   ///< 7-bit slave address, 0 for the address the device was opened with
+    int read;   ///< Non-zero to read len bytes into buf, zero to write len bytes from buf
+    void *buf;  ///< Data to write, or room for the data read
+    int len;    ///< Length of buf
+    int status; ///< Set by the batch: len on success, negative errno if the transfer carrying the message failed or was not attempted
+} i2cbus_msg;
+
+/**
+ * @brief Priority class of a request submitted to the worker of a bus with
+ * {@link i2cbus_submit}. The worker always takes the oldest request of the
+ * most urgent class that has one waiting.
+ *
+ */
+typedef enum
+{
+    I2CBUS_PRIO_ESTOP = 0,    ///< Emergency stop, ahead of everything else
+    I2CBUS_PRIO_STEP,         ///< Step frames
+    I2CBUS_PRIO_HOUSEKEEPING, ///< Configuration, status reads and everything else
+    I2CBUS_PRIO_NUM           ///< Number of priority classes
+} i2cbus_prio;
+
+struct i2cbus_req;
+
+/**
+ * @brief Completion callback of a request, called on the thread that ran the
+ * request (the worker of the bus) once the messages are transferred or failed.
+ * It must not block; the request is not done until it returns.
+ *
+ */
+typedef void (*i2cbus_callback)(struct i2cbus_req *req, void *user);
+
+/**
+ * @brief Wait statistics of the cross-process lock of a bus, for this process,
+ * see {@link i2cbus_xproc_lock_open}.
+ *
+ */
+typedef struct
+{
+    uint64_t acquisitions; ///< Times the lock was taken
+    uint64_t contended;    ///< Times the lock was held by another process (or a thread not yet holding the bus lock) when asked for
+    uint64_t timeouts;     ///< Times the wait for the lock timed out
+    uint64_t owner_deaths; ///< Times the lock was recovered from a process that died holding it
+    uint64_t wait_ns;      ///< Total time spent waiting for the lock, ns
+    uint64_t wait_max_ns;  ///< Longest wait for the lock, ns
+} i2cbus_xproc_stats;
+
+/**
+ * @brief Statistics and configuration of a bus, see {@link i2cbus_get_stats}.
+ *
+ */
+typedef struct
+{
+    uint64_t transfers;    ///< Transfers made on the bus by this process
+    uint64_t errors;       ///< Transfers that failed
+    uint64_t contended;    ///< Times a thread had to wait for the bus lock
+    uint64_t lock_wait_ns; ///< Total time spent waiting for the bus lock, ns
+    int devices;           ///< Devices open on the bus
+    int worker;            ///< Non-zero if the bus has an I/O worker
+    int worker_priority;   ///< SCHED_FIFO priority of the worker, 0 for the default scheduler
+    const char *backend;   ///< Name of the transport of the bus
+} i2cbus_stats;
+
+struct i2cbus_bus;
 
 /**
  * @brief Structure describing an I2C bus.
@@ -23,8 +120,39 @@ typedef struct
 {
     int fd;                ///< I2C device file descriptor
     int id;                ///< I2C device file id (X in /dev/i2c-X)
-    pthread_mutex_t *lock; ///< Lock corresponding to the /dev/i2c-X file, assigned from the locks array indexed by id
+    int addr;              ///< I2C slave address
+    pthread_mutex_t *lock; ///< Lock of the bus the device is on, shared by all devices of the bus
+    const i2cbus_backend *backend; ///< Transport the device was opened with
+    int shared;            ///< Non-zero if fd is the descriptor of the bus shared with other devices, see {@link i2cbus_open_shared}
+    struct i2cbus_bus *bus; ///< Bus the device is on, created by the first device opened on it and freed with the last one
 } i2cbus;
+/**
+ * @brief Batch of messages submitted to the worker of a bus with
+ * {@link i2cbus_submit}. The caller owns the memory of the request and its
+ * messages, which have to stay valid until the request is done.
+ *
+ */
+typedef struct i2cbus_req
+{
+    i2cbus *dev;        ///< Device the batch is sent through, see {@link i2cbus_transfer_batch}
+    i2cbus_msg *msgs;   ///< Messages to send, their status fields are filled in
+    int n;              ///< Number of messages
+    i2cbus_prio prio;   ///< Priority class
+    i2cbus_callback cb; ///< Called when the request is done, can be NULL
+    void *user;         ///< Passed to cb
+    int result;         ///< Set when done: messages transferred, -1 on invalid arguments
+    struct i2cbus_req *next; ///< Private: link in the submission queue
+    int state;          ///< Private: progress of the request
+    sem_t done;         ///< Private: posted by the worker for i2cbus_req_wait
+} i2cbus_req;
+
+/**
+ * @brief Select the transport of the buses that come into use after this call.
+ * Devices opened on a bus already in use get the transport of the bus.
+ *
+ * @param backend Backend to use, NULL to restore the /dev/i2c-X backend.
+ */
+void i2cbus_set_backend(const i2cbus_backend *backend);
 /**
  * @brief Open an I2C bus file descriptor using the supplied parameters.
  * 
@@ -35,6 +163,20 @@ typedef struct
  * @return int fd, non-negative on success, negative on error. See open() for details.
  */
 int i2cbus_open(i2cbus *dev, int id, int addr);
+/**
+ * @brief Open an I2C device on the descriptor of its bus, shared with the other
+ * devices on the bus opened this way, instead of a descriptor of its own bound
+ * to the slave with I2C_SLAVE. Every transfer of the device carries the slave
+ * address (I2C_RDWR), so a batch sent with {@link i2cbus_transfer_batch}
+ * through any device of the bus can address all of them in one kernel call.
+ * The descriptor is closed with the last device using it.
+ *
+ * @param dev i2c device descriptor
+ * @param id i2c device file ID (X in /dev/i2c-X)
+ * @param addr i2c slave address
+ * @return int fd, non-negative on success, negative on error. See open() for details.
+ */
+int i2cbus_open_shared(i2cbus *dev, int id, int addr);
 /**
  * @brief Close the file descriptor for the I2C device. 
  * 
@@ -86,10 +228,101 @@ int i2cbus_xfer(i2cbus *dev,
                 void *inbuf, int inlen,
                 unsigned long timeout_usec);
 /**
- * @brief Acquire lock on an i2c bus.
+ * @brief Write bytes to the i2c device, then read the reply after a repeated
+ * start, without releasing the bus in between (I2C_RDWR). Use this to read
+ * registers: the write sets the register pointer, the read returns its contents.
+ * Unlike {@link i2cbus_xfer}, no delay is needed between the write and the read.
+ *
+ * Note: Bus access by this function is protected by a recursive
+ * pthread mutex.
+ *
+ * @param dev i2c device descriptor
+ * @param outbuf Pointer to byte array to write (MSB first)
+ * @param outlen Length of output byte array
+ * @param inbuf Pointer to byte array to read to (MSB first)
+ * @param inlen Length of input byte array
+ * @return int Length of bytes read on success, -1 on failure
+ */
+int i2cbus_write_read(i2cbus *dev,
+                      const void *outbuf, int outlen,
+                      void *inbuf, int inlen);
+/**
+ * @brief Send several write and read messages, possibly to different slave
+ * addresses, as combined transfers (I2C_RDWR) under one acquisition of the bus
+ * lock. Messages are sent in order, {@link I2CBUS_BATCH_MAX} per transfer with
+ * repeated starts in between, so a PCA9685 latches all the writes of a transfer
+ * on its one STOP condition. A failed transfer ends the batch: its messages get
+ * the error, the messages after it get -ECANCELED.
+ *
+ * Note: Bus access by this function is protected by a recursive
+ * pthread mutex.
+ *
+ * @param dev i2c device descriptor the batch is sent through
+ * @param msgs Messages to send, their status fields are filled in
+ * @param n Number of messages
+ * @return int Number of messages transferred (n on success), -1 on invalid arguments
+ */
+int i2cbus_transfer_batch(i2cbus *dev, i2cbus_msg *msgs, int n);
+/**
+ * @brief Start the I/O worker of a bus: a thread that runs the requests
+ * submitted with {@link i2cbus_submit} for all devices on the bus, in order
+ * of priority class. Submitting does not take a lock, so a thread queueing a
+ * step frame never waits on the bus mutex behind another thread's transfer,
+ * only on the completion of its own request. Without a worker, requests run
+ * in the submitting thread.
+ *
+ * @param id Bus index (X in /dev/i2c-X)
+ * @param priority SCHED_FIFO priority of the worker (1-99), 0 for the default scheduler
+ * @return int 1 on success, 0 if a worker already runs, negative on error (negative errno of pthread_create, e.g. -EPERM for a refused priority)
+ */
+int i2cbus_worker_start(int id, int priority);
+/**
+ * @brief Stop the I/O worker of a bus, after the requests already submitted
+ * have run. Requests submitted afterwards run in the submitting thread.
+ *
+ * @param id Bus index (X in /dev/i2c-X)
+ * @return int 1 on success, 0 if no worker runs, negative on error
+ */
+int i2cbus_worker_stop(int id);
+/**
+ * @brief Check whether a bus has an I/O worker.
+ *
+ * @param id Bus index (X in /dev/i2c-X)
+ * @return int 1 if a worker runs, 0 otherwise
+ */
+int i2cbus_worker_running(int id);
+/**
+ * @brief Submit a batch of messages to the worker of the bus of req->dev, or
+ * run it now in the calling thread if the bus has no worker. Queueing is
+ * lock-free; completion is reported through req->cb and can be waited for
+ * with {@link i2cbus_req_wait}. A request can be submitted again once it is done.
+ *
+ * @param req Request, with dev, msgs, n, prio, cb and user filled in
+ * @return int 1 if queued, 0 if run in the calling thread, -1 on invalid arguments
+ */
+int i2cbus_submit(i2cbus_req *req);
+/**
+ * @brief Check whether a submitted request is done, without blocking.
+ *
+ * @param req Submitted request
+ * @return int Non-zero once the request is done and its callback has returned
+ */
+int i2cbus_req_done(const i2cbus_req *req);
+/**
+ * @brief Wait for a submitted request to be done. Only one thread may wait
+ * on a request.
+ *
+ * @param req Submitted request
+ * @param timeout_usec Time to wait in microseconds, negative to wait indefinitely
+ * @return int req->result once done, -ETIMEDOUT on timeout
+ */
+int i2cbus_req_wait(i2cbus_req *req, long timeout_usec);
+/**
+ * @brief Acquire lock on an i2c bus. The bus stays in use until the matching
+ * {@link i2cbus_unlock}, even if its devices are closed in between.
  * 
  * @param bus Bus index (X in /dev/i2c-X)
- * @return int Positive on success, negative on error (negative of error returned by pthread_mutex_lock)
+ * @return int Positive on success, negative on error (negative of error returned by pthread_mutex_lock, -ETIMEDOUT if the cross-process lock was not released in time, -100 if the bus is not in use)
  */
 int i2cbus_lock(unsigned int bus);
 /**
@@ -97,16 +330,69 @@ int i2cbus_lock(unsigned int bus);
  * for timing jitter sensitive applications.
  * 
  * @param bus Bus index (X in /dev/i2c-X)
- * @return int Positive on success, negative on error (negative of error returned by pthread_mutex_trylock)
+ * @return int Positive on success, negative on error (negative of error returned by pthread_mutex_trylock, -100 if the bus is not in use)
  */
 int i2cbus_trylock(unsigned int bus);
 /**
  * @brief Unlock an i2c bus.
  * 
  * @param bus Bus index (X in /dev/i2c-X)
- * @return int int Positive on success, negative on error (negative of error returned by pthread_mutex_lock)
+ * @return int int Positive on success, negative on error (negative of error returned by pthread_mutex_unlock, -EPERM if the calling thread does not hold the bus, -100 if the bus is not in use)
  */
 int i2cbus_unlock(unsigned int bus);
+/**
+ * @brief Arbitrate a bus with other processes: every acquisition of the bus
+ * lock in this process (each transfer, and {@link i2cbus_lock}) also takes a
+ * robust, process-shared mutex in a named shared memory segment, so transfers
+ * of processes opting in do not interleave. A process that dies holding the
+ * bus is detected and the lock recovered. The wait for the other processes is
+ * bounded: a transfer that times out fails with errno ETIMEDOUT. The segment
+ * is created for the owner and group of the process only (0660, less the
+ * umask); a segment left uninitialized by an opener that died is initialized
+ * by the next one.
+ *
+ * @param id Bus index (X in /dev/i2c-X)
+ * @param name Name of the shared memory segment (shm_open), NULL for "/i2cbus-X"
+ * @param timeout_usec Longest wait for the lock in microseconds, negative to wait indefinitely
+ * @return int 1 on success, negative on error (negative errno, -EBUSY if the bus already has a cross-process lock)
+ */
+int i2cbus_xproc_lock_open(int id, const char *name, long timeout_usec);
+/**
+ * @brief Stop arbitrating a bus with other processes. The shared memory
+ * segment is left in place for the other processes.
+ *
+ * @param id Bus index (X in /dev/i2c-X)
+ * @return int 1 on success, 0 if the bus has no cross-process lock, negative on error (-EBUSY if the calling thread holds the bus)
+ */
+int i2cbus_xproc_lock_close(int id);
+/**
+ * @brief Get the wait statistics of the cross-process lock of a bus, for this
+ * process, since {@link i2cbus_xproc_lock_open}.
+ *
+ * @param id Bus index (X in /dev/i2c-X)
+ * @param stats Filled with the statistics
+ * @return int 1 if the bus has a cross-process lock, 0 if not, negative on error
+ */
+int i2cbus_xproc_lock_stats(int id, i2cbus_xproc_stats *stats);
+/**
+ * @brief Get the statistics and configuration of a bus. Buses are created when
+ * the first device, worker or cross-process lock on them is opened, with
+ * their own lock, and freed when the last one is closed; any bus index can
+ * be used.
+ *
+ * @param id Bus index (X in /dev/i2c-X)
+ * @param stats Filled with the statistics, zeroed if the bus is not in use
+ * @return int 1 if the bus is in use, 0 if not, negative on error
+ */
+int i2cbus_get_stats(int id, i2cbus_stats *stats);
+/**
+ * @brief List the buses in use.
+ *
+ * @param ids Filled with up to max bus indices, can be NULL
+ * @param max Room in ids
+ * @return int Number of buses in use, can be larger than max
+ */
+int i2cbus_list(int *ids, int max);
 #ifdef __cplusplus 
 }
 #endif
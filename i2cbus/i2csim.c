@@ -0,0 +1,474 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "i2csim.h"
+
+#ifdef eprintf
+#undef eprintf
+#endif
+
+#define eprintf(str, ...)                                                                       \
+    {                                                                                           \
+        fprintf(stderr, "[%s/%s():%d] " str "\n", __FILE__, __func__, __LINE__, ##__VA_ARGS__); \
+        fflush(stderr);                                                                         \
+    }
+
+#define I2CSIM_MAX_BUSES 8 /// Bus indices the simulator keeps counters for
+
+// PCA9685 registers and bits emulated by the simulator
+#define SIM_MODE1 0x00
+#define SIM_MODE2 0x01
+#define SIM_ALLCALLADR 0x05
+#define SIM_LED0 0x06
+#define SIM_LED15_END 0x45 // LED15_OFF_H
+#define SIM_ALLLED 0xFA
+#define SIM_ALLLED_END 0xFD
+#define SIM_PRESCALE 0xFE
+
+#define SIM_MODE1_RESTART 0x80
+#define SIM_MODE1_AI 0x20
+#define SIM_MODE1_SLEEP 0x10
+#define SIM_MODE1_ALLCALL 0x01
+#define SIM_MODE2_OCH 0x08
+
+/**
+ * @brief State of one simulated PCA9685.
+ *
+ */
+typedef struct
+{
+    int used;
+    int bus;
+    int addr;
+    uint8_t ptr;       // register pointer
+    uint8_t regs[256]; // register file
+} sim_pca9685;
+
+/**
+ * @brief An open simulated device, equivalent of an fd with I2C_SLAVE set.
+ *
+ */
+typedef struct
+{
+    int used;
+    int bus;
+    int addr;
+} sim_handle;
+
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER; /// Guards all simulator state
+static sim_pca9685 sim_devs[I2CSIM_MAX_DEVICES];
+static sim_handle sim_handles[I2CSIM_MAX_HANDLES];
+static i2csim_stats sim_stats[I2CSIM_MAX_BUSES];
+static unsigned int sim_byte_ns = 0;
+static i2csim_event *sim_history = NULL;
+static size_t sim_history_len = 0;
+static size_t sim_history_head = 0;  // next slot to write
+static size_t sim_history_count = 0; // valid events in the ring
+static uint64_t sim_history_drops = 0;
+
+static inline uint64_t sim_timestamp()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000000LLU + ts.tv_nsec);
+}
+
+/**
+ * @brief Hold the bus until deadline. Sleeps for most of the wait and spins
+ * for the rest, so short transfers are timed accurately.
+ *
+ */
+static void sim_wait_until(uint64_t deadline)
+{
+    uint64_t now = sim_timestamp();
+    if (deadline > now + 100000)
+    {
+        uint64_t wake = deadline - 50000;
+        struct timespec ts = {.tv_sec = wake / 1000000000LLU, .tv_nsec = wake % 1000000000LLU};
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+            ;
+    }
+    while (sim_timestamp() < deadline)
+        ;
+}
+
+static void sim_record(const sim_pca9685 *dev, uint8_t reg, uint8_t val, uint64_t tstamp)
+{
+    if (sim_history_len == 0)
+        return;
+    i2csim_event *ev = &sim_history[sim_history_head];
+    ev->tstamp = tstamp;
+    ev->bus = dev->bus;
+    ev->addr = dev->addr;
+    ev->reg = reg;
+    ev->val = val;
+    sim_history_head = (sim_history_head + 1) % sim_history_len;
+    if (sim_history_count < sim_history_len)
+        sim_history_count++;
+    else
+        sim_history_drops++;
+}
+
+static void sim_reset_device(sim_pca9685 *dev)
+{
+    // power-on state, PCA9685 datasheet section 7.3
+    memset(dev->regs, 0, sizeof(dev->regs));
+    dev->regs[SIM_MODE1] = SIM_MODE1_SLEEP | SIM_MODE1_ALLCALL;
+    dev->regs[SIM_MODE2] = 0x04;
+    dev->regs[0x02] = 0xE2; // SUBADR1
+    dev->regs[0x03] = 0xE4; // SUBADR2
+    dev->regs[0x04] = 0xE8; // SUBADR3
+    dev->regs[SIM_ALLCALLADR] = 0xE0;
+    for (int i = 0; i < 16; i++)
+        dev->regs[SIM_LED0 + 4 * i + 3] = 0x10; // LEDn_OFF_H: full off
+    dev->regs[SIM_PRESCALE] = 0x1E;
+    dev->ptr = 0;
+}
+
+static void sim_advance(sim_pca9685 *dev)
+{
+    if (!(dev->regs[SIM_MODE1] & SIM_MODE1_AI))
+        return;
+    if (dev->ptr == SIM_LED15_END)
+        dev->ptr = SIM_MODE1;
+    else if (dev->ptr == SIM_ALLLED_END)
+        dev->ptr = SIM_ALLLED;
+    else
+        dev->ptr++;
+}
+
+static void sim_write_reg(sim_pca9685 *dev, uint8_t reg, uint8_t val, uint64_t tstamp)
+{
+    if (reg == SIM_MODE1)
+    {
+        uint8_t old = dev->regs[SIM_MODE1];
+        // RESTART is cleared by writing 1, and set when the oscillator is stopped with PWM active
+        uint8_t restart = (val & SIM_MODE1_RESTART) ? 0 : (old & SIM_MODE1_RESTART);
+        if ((val & SIM_MODE1_SLEEP) && !(old & SIM_MODE1_SLEEP))
+            restart = SIM_MODE1_RESTART;
+        val = (val & ~SIM_MODE1_RESTART) | restart;
+    }
+    else if (reg == SIM_PRESCALE)
+    {
+        if (!(dev->regs[SIM_MODE1] & SIM_MODE1_SLEEP)) // write protected while the oscillator runs
+            return;
+    }
+    else if (reg >= SIM_ALLLED && reg <= SIM_ALLLED_END)
+    {
+        for (int i = 0; i < 16; i++)
+        {
+            uint8_t led = SIM_LED0 + 4 * i + (reg - SIM_ALLLED);
+            dev->regs[led] = val;
+            sim_record(dev, led, val, tstamp);
+        }
+        return; // ALL_LED registers read back as 0
+    }
+    dev->regs[reg] = val;
+    sim_record(dev, reg, val, tstamp);
+}
+
+static sim_pca9685 *sim_find_device(int bus, int addr)
+{
+    for (int i = 0; i < I2CSIM_MAX_DEVICES; i++)
+        if (sim_devs[i].used && sim_devs[i].bus == bus && sim_devs[i].addr == addr)
+            return &sim_devs[i];
+    return NULL;
+}
+
+static int sim_accepts_allcall(const sim_pca9685 *dev, int bus, int addr)
+{
+    return dev->used && dev->bus == bus && (dev->regs[SIM_MODE1] & SIM_MODE1_ALLCALL) && (dev->regs[SIM_ALLCALLADR] >> 1) == addr;
+}
+
+/**
+ * @brief Deliver one message to a device. Writes set the register pointer
+ * with the first byte and store the rest, reads return registers from the
+ * pointer on.
+ *
+ * @param tstamp Time the transfer carrying this message ends
+ * @param byte_start Time the first data byte of this message is acknowledged
+ */
+static void sim_message(sim_pca9685 *dev, int read, uint8_t *buf, int len, uint64_t tstamp, uint64_t byte_start)
+{
+    if (read)
+    {
+        for (int i = 0; i < len; i++)
+        {
+            buf[i] = (dev->ptr >= SIM_ALLLED && dev->ptr <= SIM_ALLLED_END) ? 0 : dev->regs[dev->ptr];
+            sim_advance(dev);
+        }
+        return;
+    }
+    if (len < 1)
+        return;
+    dev->ptr = buf[0];
+    for (int i = 1; i < len; i++)
+    {
+        // with OCH set outputs change on every ACK instead of on the STOP
+        uint64_t ts = (dev->regs[SIM_MODE2] & SIM_MODE2_OCH) ? byte_start + (uint64_t)i * sim_byte_ns : tstamp;
+        sim_write_reg(dev, dev->ptr, buf[i], ts);
+        sim_advance(dev);
+    }
+}
+
+/**
+ * @brief Run a transfer of nmsgs messages as one START ... STOP on the bus.
+ * Called with the bus lock held, so the bus time spent here is seen by other
+ * threads as contention.
+ *
+ */
+static int sim_transfer(int fd, struct i2c_msg *msgs, int nmsgs)
+{
+    if (fd < 1 || fd > I2CSIM_MAX_HANDLES)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    pthread_mutex_lock(&sim_lock);
+    sim_handle *h = &sim_handles[fd - 1];
+    if (!h->used)
+    {
+        pthread_mutex_unlock(&sim_lock);
+        errno = EBADF;
+        return -1;
+    }
+    int bus = h->bus;
+    uint64_t bytes = 0;
+    for (int i = 0; i < nmsgs; i++)
+        bytes += 1 + msgs[i].len; // address byte + data
+    unsigned int byte_ns = sim_byte_ns;
+    pthread_mutex_unlock(&sim_lock);
+
+    uint64_t start = sim_timestamp();
+    uint64_t end = start + bytes * byte_ns;
+    sim_wait_until(end);
+
+    pthread_mutex_lock(&sim_lock);
+    i2csim_stats *st = bus < I2CSIM_MAX_BUSES ? &sim_stats[bus] : NULL;
+    uint64_t byte_start = start;
+    int ret = nmsgs;
+    for (int i = 0; i < nmsgs && ret == nmsgs; i++)
+    {
+        int read = msgs[i].flags & I2C_M_RD;
+        int found = 0;
+        byte_start += byte_ns; // address byte
+        for (int d = 0; d < I2CSIM_MAX_DEVICES; d++)
+        {
+            sim_pca9685 *dev = &sim_devs[d];
+            if (dev->used && dev->bus == bus && dev->addr == msgs[i].addr)
+            {
+                sim_message(dev, read, msgs[i].buf, msgs[i].len, end, byte_start);
+                found = 1;
+            }
+            else if (!read && sim_accepts_allcall(dev, bus, msgs[i].addr))
+            {
+                sim_message(dev, read, msgs[i].buf, msgs[i].len, end, byte_start);
+                found = 1;
+            }
+        }
+        byte_start += (uint64_t)msgs[i].len * byte_ns;
+        if (!found)
+        {
+            errno = ENXIO;
+            ret = -1;
+        }
+    }
+    if (st != NULL)
+    {
+        st->transfers++;
+        st->messages += nmsgs;
+        st->bytes += bytes;
+        st->busy_ns += end - start;
+        if (ret < 0)
+            st->nacks++;
+    }
+    pthread_mutex_unlock(&sim_lock);
+    return ret;
+}
+
+static int sim_open(int id, int addr)
+{
+    pthread_mutex_lock(&sim_lock);
+    for (int i = 0; i < I2CSIM_MAX_HANDLES; i++)
+    {
+        if (!sim_handles[i].used)
+        {
+            sim_handles[i].used = 1;
+            sim_handles[i].bus = id;
+            sim_handles[i].addr = addr;
+            pthread_mutex_unlock(&sim_lock);
+            return i + 1; // handles are positive, like fds returned by open
+        }
+    }
+    pthread_mutex_unlock(&sim_lock);
+    eprintf("Out of simulated device handles");
+    return -EMFILE;
+}
+
+static int sim_close(int fd)
+{
+    if (fd < 1 || fd > I2CSIM_MAX_HANDLES)
+        return -1;
+    pthread_mutex_lock(&sim_lock);
+    sim_handles[fd - 1].used = 0;
+    pthread_mutex_unlock(&sim_lock);
+    return 0;
+}
+
+static int sim_write(int fd, const void *buf, int len)
+{
+    if (fd < 1 || fd > I2CSIM_MAX_HANDLES)
+        return -1;
+    struct i2c_msg msg = {.addr = sim_handles[fd - 1].addr, .flags = 0, .len = len, .buf = (uint8_t *)buf};
+    return sim_transfer(fd, &msg, 1) == 1 ? len : -1;
+}
+
+static int sim_read(int fd, void *buf, int len)
+{
+    if (fd < 1 || fd > I2CSIM_MAX_HANDLES)
+        return -1;
+    struct i2c_msg msg = {.addr = sim_handles[fd - 1].addr, .flags = I2C_M_RD, .len = len, .buf = (uint8_t *)buf};
+    return sim_transfer(fd, &msg, 1) == 1 ? len : -1;
+}
+
+static const i2cbus_backend sim_backend = {
+    .name = "pca9685-sim",
+    .open = sim_open,
+    .close = sim_close,
+    .write = sim_write,
+    .read = sim_read,
+    .rdwr = sim_transfer};
+
+int i2csim_init(unsigned int byte_ns, size_t history_len)
+{
+    pthread_mutex_lock(&sim_lock);
+    free(sim_history);
+    sim_history = NULL;
+    if (history_len > 0)
+    {
+        sim_history = (i2csim_event *)calloc(history_len, sizeof(i2csim_event));
+        if (sim_history == NULL)
+        {
+            pthread_mutex_unlock(&sim_lock);
+            eprintf("Could not allocate history of %zu events", history_len);
+            return -1;
+        }
+    }
+    sim_history_len = history_len;
+    sim_history_head = sim_history_count = 0;
+    sim_history_drops = 0;
+    sim_byte_ns = byte_ns;
+    memset(sim_devs, 0, sizeof(sim_devs));
+    memset(sim_handles, 0, sizeof(sim_handles));
+    memset(sim_stats, 0, sizeof(sim_stats));
+    pthread_mutex_unlock(&sim_lock);
+    i2cbus_set_backend(&sim_backend);
+    return 1;
+}
+
+void i2csim_destroy(void)
+{
+    i2cbus_set_backend(NULL);
+    pthread_mutex_lock(&sim_lock);
+    free(sim_history);
+    sim_history = NULL;
+    sim_history_len = sim_history_head = sim_history_count = 0;
+    memset(sim_devs, 0, sizeof(sim_devs));
+    memset(sim_handles, 0, sizeof(sim_handles));
+    pthread_mutex_unlock(&sim_lock);
+}
+
+int i2csim_add_pca9685(int bus, int addr)
+{
+    if (bus < 0 || addr < 8 || addr > 0x77)
+    {
+        eprintf("Invalid bus %d or address 0x%02x", bus, addr);
+        return -1;
+    }
+    pthread_mutex_lock(&sim_lock);
+    if (sim_find_device(bus, addr) != NULL)
+    {
+        pthread_mutex_unlock(&sim_lock);
+        eprintf("Device 0x%02x already exists on bus %d", addr, bus);
+        return -2;
+    }
+    for (int i = 0; i < I2CSIM_MAX_DEVICES; i++)
+    {
+        if (!sim_devs[i].used)
+        {
+            sim_devs[i].used = 1;
+            sim_devs[i].bus = bus;
+            sim_devs[i].addr = addr;
+            sim_reset_device(&sim_devs[i]);
+            pthread_mutex_unlock(&sim_lock);
+            return 1;
+        }
+    }
+    pthread_mutex_unlock(&sim_lock);
+    eprintf("Out of simulated devices, maximum is %d", I2CSIM_MAX_DEVICES);
+    return -3;
+}
+
+void i2csim_set_byte_latency(unsigned int byte_ns)
+{
+    pthread_mutex_lock(&sim_lock);
+    sim_byte_ns = byte_ns;
+    pthread_mutex_unlock(&sim_lock);
+}
+
+int i2csim_get_regs(int bus, int addr, uint8_t regs[256])
+{
+    pthread_mutex_lock(&sim_lock);
+    sim_pca9685 *dev = sim_find_device(bus, addr);
+    if (dev != NULL)
+        memcpy(regs, dev->regs, sizeof(dev->regs));
+    pthread_mutex_unlock(&sim_lock);
+    return dev != NULL ? 1 : -1;
+}
+
+size_t i2csim_history(i2csim_event *events, size_t max)
+{
+    pthread_mutex_lock(&sim_lock);
+    size_t n = sim_history_count < max ? sim_history_count : max;
+    size_t first = (sim_history_head + sim_history_len - sim_history_count) % (sim_history_len ? sim_history_len : 1);
+    for (size_t i = 0; i < n; i++)
+        events[i] = sim_history[(first + i) % sim_history_len];
+    pthread_mutex_unlock(&sim_lock);
+    return n;
+}
+
+uint64_t i2csim_history_dropped(void)
+{
+    pthread_mutex_lock(&sim_lock);
+    uint64_t drops = sim_history_drops;
+    pthread_mutex_unlock(&sim_lock);
+    return drops;
+}
+
+void i2csim_history_clear(void)
+{
+    pthread_mutex_lock(&sim_lock);
+    sim_history_head = sim_history_count = 0;
+    sim_history_drops = 0;
+    pthread_mutex_unlock(&sim_lock);
+}
+
+int i2csim_get_stats(int bus, i2csim_stats *stats)
+{
+    if (bus < 0 || bus >= I2CSIM_MAX_BUSES || stats == NULL)
+        return -1;
+    pthread_mutex_lock(&sim_lock);
+    *stats = sim_stats[bus];
+    pthread_mutex_unlock(&sim_lock);
+    return 1;
+}
+
+void i2csim_reset_stats(void)
+{
+    pthread_mutex_lock(&sim_lock);
+    memset(sim_stats, 0, sizeof(sim_stats));
+    pthread_mutex_unlock(&sim_lock);
+}
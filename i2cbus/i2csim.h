@@ -0,0 +1,143 @@
+/**
+ * @file i2csim.h
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief In-process PCA9685 simulator backend for i2cbus. Lets the motor
+ * shield code run and be benchmarked without hardware.
+ * @version 0.1
+ * @date 2022-04-09
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#ifndef __I2CSIM_H
+#define __I2CSIM_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <stdint.h>
+#include <stddef.h>
+#include "i2cbus.h"
+
+#ifndef I2CSIM_MAX_DEVICES
+#define I2CSIM_MAX_DEVICES 16 /// Maximum number of simulated PCA9685s across all buses
+#endif
+
+#ifndef I2CSIM_MAX_HANDLES
+#define I2CSIM_MAX_HANDLES 64 /// Maximum number of simultaneously open simulated devices
+#endif
+
+/**
+ * @brief Byte time of a 400 kHz bus: 8 data bits and the ACK.
+ *
+ */
+#define I2CSIM_BYTE_NS_400K 22500
+
+/**
+ * @brief One register write seen by a simulated PCA9685.
+ *
+ */
+typedef struct
+{
+    uint64_t tstamp; ///< CLOCK_MONOTONIC time (ns) at which the outputs took the value: the STOP condition, or the ACK if MODE2 OCH is set
+    uint8_t bus;     ///< Bus index (X in /dev/i2c-X)
+    uint8_t addr;    ///< Device address, ALLCALL writes are recorded for every device that accepted them
+    uint8_t reg;     ///< Register address, ALL_LED writes are recorded as the LEDn registers they changed
+    uint8_t val;     ///< Value written
+} i2csim_event;
+
+/**
+ * @brief Bus traffic counters of the simulator.
+ *
+ */
+typedef struct
+{
+    uint64_t transfers; ///< Transfers (START to STOP)
+    uint64_t messages;  ///< Messages, a combined transfer has more than one
+    uint64_t bytes;     ///< Bytes on the wire, including the address byte of every message
+    uint64_t busy_ns;   ///< Time the bus was held by transfers
+    uint64_t nacks;     ///< Transfers that were not acknowledged
+} i2csim_stats;
+
+/**
+ * @brief Install the simulator as the i2cbus backend. Devices opened after
+ * this call talk to the simulated PCA9685s added with {@link i2csim_add_pca9685}.
+ *
+ * @param byte_ns Time the bus is held per byte, in nanoseconds (0 for no delay, {@link I2CSIM_BYTE_NS_400K} for a 400 kHz bus).
+ * @param history_len Number of register writes kept in the history ring, 0 to disable the history.
+ * @return int 1 on success, negative on error.
+ */
+int i2csim_init(unsigned int byte_ns, size_t history_len);
+
+/**
+ * @brief Restore the /dev/i2c-X backend and remove all simulated devices.
+ * Devices opened with the simulator must be closed before this call.
+ *
+ */
+void i2csim_destroy(void);
+
+/**
+ * @brief Add a PCA9685 in its power-on state to a simulated bus.
+ *
+ * @param bus Bus index (X in /dev/i2c-X).
+ * @param addr 7-bit slave address.
+ * @return int 1 on success, negative on error.
+ */
+int i2csim_add_pca9685(int bus, int addr);
+
+/**
+ * @brief Change the time the bus is held per byte.
+ *
+ * @param byte_ns Byte time in nanoseconds.
+ */
+void i2csim_set_byte_latency(unsigned int byte_ns);
+
+/**
+ * @brief Copy the register file of a simulated PCA9685.
+ *
+ * @param bus Bus index (X in /dev/i2c-X).
+ * @param addr 7-bit slave address.
+ * @param regs Register contents, indexed by register address.
+ * @return int 1 on success, negative if the device does not exist.
+ */
+int i2csim_get_regs(int bus, int addr, uint8_t regs[256]);
+
+/**
+ * @brief Copy the register write history, oldest first.
+ *
+ * @param events Output array.
+ * @param max Size of the output array.
+ * @return size_t Number of events copied.
+ */
+size_t i2csim_history(i2csim_event *events, size_t max);
+
+/**
+ * @brief Get the number of register writes dropped because the history ring was full.
+ *
+ * @return uint64_t Dropped events.
+ */
+uint64_t i2csim_history_dropped(void);
+
+/**
+ * @brief Clear the register write history.
+ *
+ */
+void i2csim_history_clear(void);
+
+/**
+ * @brief Get the traffic counters of a simulated bus.
+ *
+ * @param bus Bus index (X in /dev/i2c-X).
+ * @param stats Counters.
+ * @return int 1 on success, negative on error.
+ */
+int i2csim_get_stats(int bus, i2csim_stats *stats);
+
+/**
+ * @brief Reset the traffic counters of all simulated buses.
+ *
+ */
+void i2csim_reset_stats(void);
+#ifdef __cplusplus
+}
+#endif
+#endif
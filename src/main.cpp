@@ -16,6 +16,7 @@
 #include <string.h>
 #include <math.h>
 #include <limits.h>
+#include <time.h>
 
 #include "main_ui.h"
 #include "Adafruit/meb_print.h"
@@ -24,6 +25,7 @@
 #include "iomotor.hpp"
 
 #include <string>
+#include <thread>
 
 #define STEP_TO_LAM ((double)0.008014342)
 
@@ -1042,32 +1044,39 @@ static void MotorCleanup()
     delete ioshield;
 }
 
-static void MotorSetup()
+static void ShieldBegin(Adafruit::MotorShield *shield, const char *name)
 {
-    // Instantiation.
-    atexit(ValidateCurrentPos); // validate current position at exit
-    scanmot_current_pos = LoadCurrentPos();
-    // dbprintlf("Instantiating MotorShield and StepperMotor with address %d, bus %d, %d steps, and port %d.", MSHIELD_ADDR, MSHIELD_BUS, M_STEPS, M_PORT);
-    sm_shield = new Adafruit::MotorShield(SMSHIELD_ADDR, MSHIELD_BUS);
     try
     {
-        sm_shield->begin();
+        shield->begin();
     }
-    catch (std::exception &e)
+    catch (const std::exception &e)
     {
         dbprintlf("Exception: %s.", e.what());
+        return;
     }
-    Adafruit::StepperMotor *scanstepper = sm_shield->getStepper(SMOT_REVS, SMOT_PORT);
+    Adafruit::ShieldStartupTiming t = shield->getStartupTiming();
+    bprintlf(GREEN_FG "%s shield startup: open %.3lf ms, mode %.3lf ms, prescale %.3lf ms%s, clear %.3lf ms, total %.3lf ms", name, t.open * 1e-6, t.mode * 1e-6, t.prescale * 1e-6, t.prescale_skipped ? " (unchanged)" : "", t.clear * 1e-6, t.total * 1e-6);
+}
 
+static void MotorSetup()
+{
+    // Instantiation.
+    atexit(ValidateCurrentPos); // validate current position at exit
+    scanmot_current_pos = LoadCurrentPos();
+    // dbprintlf("Instantiating MotorShield and StepperMotor with address %d, bus %d, %d steps, and port %d.", MSHIELD_ADDR, MSHIELD_BUS, M_STEPS, M_PORT);
+    sm_shield = new Adafruit::MotorShield(SMSHIELD_ADDR, MSHIELD_BUS);
     ioshield = new Adafruit::MotorShield(IOMSHIELD_ADDR, MSHIELD_BUS);
-    try
-    {
-        ioshield->begin();
-    }
-    catch (const std::exception &e)
-    {
-        dbprintlf("Exception: %s.", e.what());
-    }
+    // Bring both shields up at the same time, their oscillator wake-up waits overlap on the bus.
+    struct timespec setup_start, setup_end;
+    clock_gettime(CLOCK_MONOTONIC, &setup_start);
+    std::thread sm_begin(ShieldBegin, sm_shield, "Scan");
+    std::thread io_begin(ShieldBegin, ioshield, "IO");
+    sm_begin.join();
+    io_begin.join();
+    clock_gettime(CLOCK_MONOTONIC, &setup_end);
+    bprintlf(GREEN_FG "Shields ready in %.3lf ms", (setup_end.tv_sec - setup_start.tv_sec) * 1e3 + (setup_end.tv_nsec - setup_start.tv_nsec) * 1e-6);
+    Adafruit::StepperMotor *scanstepper = sm_shield->getStepper(SMOT_REVS, SMOT_PORT);
     Adafruit::StepperMotor *iostepper_in = ioshield->getStepper(IOMOT_REVS, IOMOT_A_PORT);
     Adafruit::StepperMotor *iostepper_out = ioshield->getStepper(IOMOT_REVS, IOMOT_B_PORT);
 